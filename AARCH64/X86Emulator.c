@@ -9,9 +9,197 @@
 
 #include "X86Emulator.h"
 
+#include <Library/CacheMaintenanceLib.h>
 #include <Library/DefaultExceptionHandlerLib.h>
 
 extern CONST UINT64 X86EmulatorThunk[];
+extern CONST UINT64 X86EmulatorUnloadedThunk[];
+extern CONST UINT32 X86EmulatorTrampolineTemplate[];
+
+typedef struct {
+  UINT32    Code[4];
+  UINT64    Pc;
+  UINT64    Thunk;
+} X86_TRAMPOLINE;
+
+#define X86_TRAMPOLINE_INDEX_GROW   16
+
+//
+// Trampolines handed out so far, sorted by x86 entry point. They are never
+// freed or reused, as we cannot tell whether the firmware still holds a
+// reference. Those of an unloaded image are dropped from the index and
+// stay redirected to X86EmulatorUnloadedThunk, so that a stale call fails
+// instead of reaching another function.
+//
+STATIC X86_TRAMPOLINE     **mTrampolineIndex;
+STATIC UINTN              mTrampolineCount;
+STATIC UINTN              mTrampolineIndexSize;
+STATIC X86_TRAMPOLINE     *mTrampolinePool;
+STATIC UINTN              mTrampolinePoolFree;
+
+STATIC
+X86_TRAMPOLINE *
+AllocateTrampoline (
+  IN  UINT64    Pc
+  )
+{
+  X86_TRAMPOLINE        *Trampoline;
+  EFI_PHYSICAL_ADDRESS  Alloc;
+  EFI_STATUS            Status;
+
+  if (mTrampolinePoolFree == 0) {
+    Status = gBS->AllocatePages (AllocateAnyPages, EfiBootServicesCode, 1,
+                    &Alloc);
+    if (EFI_ERROR (Status)) {
+      return NULL;
+    }
+    mTrampolinePool = (X86_TRAMPOLINE *)(UINTN)Alloc;
+    mTrampolinePoolFree = EFI_PAGE_SIZE / sizeof (X86_TRAMPOLINE);
+  }
+
+  Trampoline = mTrampolinePool++;
+  mTrampolinePoolFree--;
+
+  CopyMem (Trampoline->Code, X86EmulatorTrampolineTemplate,
+    sizeof Trampoline->Code);
+  Trampoline->Pc = Pc;
+  Trampoline->Thunk = (UINT64)X86EmulatorThunk;
+
+  InvalidateInstructionCacheRange (Trampoline, sizeof *Trampoline);
+
+  return Trampoline;
+}
+
+//
+// Return a native function pointer that enters the emulator at Pc without
+// taking an instruction abort, or Pc itself if we fail to create one.
+//
+UINT64
+X86EmulatorGetTrampoline (
+  IN  UINT64    Pc
+  )
+{
+  X86_TRAMPOLINE    **NewIndex;
+  X86_TRAMPOLINE    *Trampoline;
+  UINTN             Low;
+  UINTN             High;
+  UINTN             Mid;
+  EFI_TPL           Tpl;
+
+  Tpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  Low = 0;
+  High = mTrampolineCount;
+  while (Low < High) {
+    Mid = Low + (High - Low) / 2;
+    Trampoline = mTrampolineIndex[Mid];
+
+    if (Pc < Trampoline->Pc) {
+      High = Mid;
+    } else if (Pc > Trampoline->Pc) {
+      Low = Mid + 1;
+    } else {
+      gBS->RestoreTPL (Tpl);
+      return (UINT64)Trampoline;
+    }
+  }
+
+  if (mTrampolineCount == mTrampolineIndexSize) {
+    NewIndex = AllocatePool ((mTrampolineIndexSize +
+                              X86_TRAMPOLINE_INDEX_GROW) * sizeof *NewIndex);
+    if (NewIndex == NULL) {
+      gBS->RestoreTPL (Tpl);
+      return Pc;
+    }
+    if (mTrampolineIndex != NULL) {
+      CopyMem (NewIndex, mTrampolineIndex,
+        mTrampolineCount * sizeof *NewIndex);
+      FreePool (mTrampolineIndex);
+    }
+    mTrampolineIndex = NewIndex;
+    mTrampolineIndexSize += X86_TRAMPOLINE_INDEX_GROW;
+  }
+
+  Trampoline = AllocateTrampoline (Pc);
+  if (Trampoline == NULL) {
+    gBS->RestoreTPL (Tpl);
+    return Pc;
+  }
+
+  CopyMem (&mTrampolineIndex[Low + 1], &mTrampolineIndex[Low],
+    (mTrampolineCount - Low) * sizeof *mTrampolineIndex);
+  mTrampolineIndex[Low] = Trampoline;
+  mTrampolineCount++;
+
+  gBS->RestoreTPL (Tpl);
+  return (UINT64)Trampoline;
+}
+
+//
+// Entered through the trampoline of an x86 function whose image has been
+// unloaded since. Fail the call rather than the firmware: the caller gets
+// EFI_UNSUPPORTED in x0, as X86EmulatorUnloadedThunk returns to it directly.
+//
+EFI_STATUS
+X86EmulatorUnloadedImageCall (
+  IN  UINT64    Pc,
+  IN  UINT64    Lr
+  )
+{
+  DEBUG ((DEBUG_ERROR,
+    "%a: call into unloaded X86 image at 0x%lx from 0x%lx\n",
+    __FUNCTION__, Pc, Lr));
+  return EFI_UNSUPPORTED;
+}
+
+//
+// Redirect the trampolines into [ImageBase, ImageBase + ImageSize) to
+// X86EmulatorUnloadedThunk, and drop them from the index so that a new
+// image loaded at the same address gets trampolines of its own.
+//
+VOID
+X86EmulatorReleaseTrampolines (
+  IN  EFI_PHYSICAL_ADDRESS    ImageBase,
+  IN  UINT64                  ImageSize
+  )
+{
+  X86_TRAMPOLINE    *Trampoline;
+  UINTN             Low;
+  UINTN             High;
+  UINTN             Mid;
+  UINTN             End;
+  EFI_TPL           Tpl;
+
+  Tpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  Low = 0;
+  High = mTrampolineCount;
+  while (Low < High) {
+    Mid = Low + (High - Low) / 2;
+    if (mTrampolineIndex[Mid]->Pc < ImageBase) {
+      Low = Mid + 1;
+    } else {
+      High = Mid;
+    }
+  }
+
+  for (End = Low; End < mTrampolineCount; End++) {
+    Trampoline = mTrampolineIndex[End];
+    if (Trampoline->Pc - ImageBase >= ImageSize) {
+      break;
+    }
+    //
+    // Only the literal changes, the code stays the same
+    //
+    Trampoline->Thunk = (UINT64)X86EmulatorUnloadedThunk;
+  }
+
+  CopyMem (&mTrampolineIndex[Low], &mTrampolineIndex[End],
+    (mTrampolineCount - End) * sizeof *mTrampolineIndex);
+  mTrampolineCount -= End - Low;
+
+  gBS->RestoreTPL (Tpl);
+}
 
 VOID
 EFIAPI
@@ -40,9 +228,7 @@ X86InterpreterSyncExceptionCallback (
   }
 
   // check whether the exception occurred in the JITed code
-  if (AArch64Context->ELR >= (UINTN)static_code_gen_buffer &&
-      AArch64Context->ELR < (UINTN)static_code_gen_buffer +
-                            EFI_PAGES_TO_SIZE (CODE_GEN_BUFFER_PAGES)) {
+  if (code_gen_region_of (AArch64Context->ELR) != NULL) {
     //
     // It looks like we crashed in the JITed code. Check whether we are
     // accessing page 0, and fix up the access in that case.
@@ -21,6 +21,30 @@ flush_icache_range (
   InvalidateInstructionCacheRange ((VOID *)Start, End - Start + 1);
 }
 
+//
+// Allocate the code space of one more region of the code buffer. Regions
+// are allocated anywhere and one at a time, as translation pressure rises:
+// branches that cannot reach from one region into another go through the
+// veneer island at the end of each region.
+//
+VOID *
+code_gen_buffer_grow (
+  IN  UINTN   Size
+  )
+{
+  EFI_PHYSICAL_ADDRESS  Address;
+  EFI_STATUS            Status;
+
+  Status = gBS->AllocatePages (AllocateAnyPages, EfiBootServicesCode,
+                  EFI_SIZE_TO_PAGES (Size), &Address);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "%a: failed to allocate a code buffer region - %r\n",
+      __FUNCTION__, Status));
+    return NULL;
+  }
+  return (VOID *)(UINTN)Address;
+}
+
 VOID
 longjmp (
   IN  VOID    *env,
@@ -0,0 +1,84 @@
+/*
+ *  Address range index of the x86 images
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include "ImageIndex.h"
+
+void *image_index_find(const ImageIndex *index, uint64_t addr)
+{
+    const ImageIndexEntry *e;
+    unsigned int low, high, mid;
+
+    low = 0;
+    high = index->count;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        e = &index->entries[mid];
+        if (addr < e->base) {
+            high = mid;
+        } else if (addr - e->base >= e->size) {
+            low = mid + 1;
+        } else {
+            return e->owner;
+        }
+    }
+    return NULL;
+}
+
+int image_index_insert(ImageIndex *index, uint64_t base, uint64_t size,
+                       void *owner)
+{
+    unsigned int i;
+
+    if (image_index_full(index))
+        return -1;
+    for (i = index->count; i > 0 && index->entries[i - 1].base > base; i--)
+        index->entries[i] = index->entries[i - 1];
+    index->entries[i].base = base;
+    index->entries[i].size = size;
+    index->entries[i].owner = owner;
+    index->count++;
+    return 0;
+}
+
+int image_index_remove(ImageIndex *index, void *owner)
+{
+    unsigned int i;
+
+    for (i = 0; i < index->count; i++) {
+        if (index->entries[i].owner == owner)
+            break;
+    }
+    if (i == index->count)
+        return -1;
+    for (index->count--; i < index->count; i++)
+        index->entries[i] = index->entries[i + 1];
+    return 0;
+}
+
+ImageIndexEntry *image_index_move(ImageIndex *index, ImageIndexEntry *entries,
+                                  unsigned int size)
+{
+    ImageIndexEntry *old = index->entries;
+    unsigned int i;
+
+    for (i = 0; i < index->count; i++)
+        entries[i] = old[i];
+    index->entries = entries;
+    index->size = size;
+    return old;
+}
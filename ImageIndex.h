@@ -0,0 +1,59 @@
+/*
+ *  Address range index of the x86 images
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IMAGE_INDEX_H__
+#define __IMAGE_INDEX_H__
+
+#include <stdint.h>
+
+/*
+ * The registered images, sorted by base address so that an address is
+ * classified with a binary search. Lookups do not write to the index and
+ * may run from nested emulator entries; insertion and removal must be
+ * serialized by the caller. The index does not allocate: the owner gives
+ * it a larger array with image_index_move() when it is full.
+ */
+typedef struct ImageIndexEntry {
+    uint64_t base;
+    uint64_t size;
+    void *owner;
+} ImageIndexEntry;
+
+typedef struct ImageIndex {
+    ImageIndexEntry *entries;
+    unsigned int count;
+    unsigned int size;
+} ImageIndex;
+
+/* owner of the image containing 'addr', or NULL */
+void *image_index_find(const ImageIndex *index, uint64_t addr);
+/* return -1 if the index is full */
+int image_index_insert(ImageIndex *index, uint64_t base, uint64_t size,
+                       void *owner);
+/* return -1 if 'owner' is not in the index */
+int image_index_remove(ImageIndex *index, void *owner);
+/* move the entries to 'entries', with room for 'size' of them, and return
+   the previous array for the caller to free */
+ImageIndexEntry *image_index_move(ImageIndex *index, ImageIndexEntry *entries,
+                                  unsigned int size);
+
+static inline int image_index_full(const ImageIndex *index)
+{
+    return index->count == index->size;
+}
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ *  QEMU Emulator glue, Linux host build
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * POSIX replacements for Glue.c, X86Emulator.c and NativeCall.c. Instead
+ * of loaded PE/COFF images, the x86 code is whatever ranges were declared
+ * with x86emu_host_add_image(), and everything else is native.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "ioport.h"
+#include "main.h"
+#include "ImageIndex.h"
+#include "X86EmulatorHost.h"
+
+#define MAX_HOST_IMAGES     128
+#define MAX_HOST_NATIVES    64
+
+typedef struct HostImage {
+    uint64_t base;
+    uint64_t size;
+    int immutable;
+    void *tb_list;
+} HostImage;
+
+typedef struct HostNative {
+    uint64_t func;
+    int nargs;
+} HostNative;
+
+static HostImage host_images[MAX_HOST_IMAGES];
+static int nb_host_images;
+/* the same index as FindImageRecord() in X86Emulator.c */
+static ImageIndexEntry host_image_entries[MAX_HOST_IMAGES];
+static ImageIndex host_image_index = {
+    .entries = host_image_entries,
+    .size = MAX_HOST_IMAGES,
+};
+static HostNative host_natives[MAX_HOST_NATIVES];
+static int nb_host_natives;
+
+uint64_t x86emu_host_io_count;
+
+/* boot services */
+
+static EFI_TPL current_tpl = TPL_APPLICATION;
+
+static EFI_TPL host_raise_tpl(EFI_TPL new_tpl)
+{
+    EFI_TPL old_tpl = current_tpl;
+
+    assert(new_tpl >= old_tpl);
+    current_tpl = new_tpl;
+    return old_tpl;
+}
+
+static void host_restore_tpl(EFI_TPL old_tpl)
+{
+    assert(old_tpl <= current_tpl);
+    current_tpl = old_tpl;
+}
+
+static EFI_BOOT_SERVICES host_boot_services = {
+    .RaiseTPL = host_raise_tpl,
+    .RestoreTPL = host_restore_tpl,
+};
+
+EFI_BOOT_SERVICES *gBS = &host_boot_services;
+
+void CpuSleep(void)
+{
+    sched_yield();
+}
+
+uint64_t GetPerformanceCounter(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* code buffer */
+
+uint8_t *code_gen_prologue;
+
+void flush_icache_range(tcg_target_ulong start, tcg_target_ulong stop)
+{
+    __builtin___clear_cache((char *)start, (char *)stop + 1);
+}
+
+static void *host_map_code(unsigned long size)
+{
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Map the prologue page. As in the UEFI build, the regions of the code
+   buffer are mapped one at a time by code_gen_buffer_grow(). */
+int x86emu_host_init(void)
+{
+    code_gen_prologue = host_map_code(getpagesize());
+    return code_gen_prologue ? 0 : -1;
+}
+
+void *code_gen_buffer_grow(unsigned long size)
+{
+    return host_map_code(size);
+}
+
+/* x86 images */
+
+int x86emu_host_add_image(void *base, unsigned long size, int immutable)
+{
+    HostImage *image;
+
+    if (nb_host_images == MAX_HOST_IMAGES)
+        return -1;
+    image = &host_images[nb_host_images++];
+    image->base = (uintptr_t)base;
+    image->size = size;
+    image->immutable = immutable;
+    image->tb_list = NULL;
+    image_index_insert(&host_image_index, image->base, size, image);
+    /* blocks are classified as x86 or native when translated */
+    x86emu_invalidate_range(image->base, size);
+    return 0;
+}
+
+static HostImage *find_host_image(uint64_t pc)
+{
+    return image_index_find(&host_image_index, pc);
+}
+
+bool pc_is_native_call(uint64_t pc)
+{
+    return find_host_image(pc) == NULL;
+}
+
+void **image_tb_list(uint64_t pc)
+{
+    HostImage *image = find_host_image(pc);
+
+    return image ? &image->tb_list : NULL;
+}
+
+int image_code_immutable(uint64_t start, uint64_t end)
+{
+    HostImage *image = find_host_image(start);
+
+    return image && image->immutable && end - image->base < image->size;
+}
+
+/* native calls */
+
+int x86emu_host_add_native(void *func, int nargs)
+{
+    if (nb_host_natives == MAX_HOST_NATIVES)
+        return -1;
+    host_natives[nb_host_natives].func = (uintptr_t)func;
+    host_natives[nb_host_natives].nargs = nargs;
+    nb_host_natives++;
+    return 0;
+}
+
+uint64_t native_call_target(uint64_t pc, int *nargs)
+{
+    int i;
+
+    for (i = 0; i < nb_host_natives; i++) {
+        if (host_natives[i].func == pc) {
+            *nargs = host_natives[i].nargs;
+            return pc;
+        }
+    }
+    *nargs = 16;
+    return pc;
+}
+
+/* port I/O: there are no devices, reads return all ones */
+
+uint8_t cpu_inb(pio_addr_t addr)
+{
+    x86emu_host_io_count++;
+    return 0xff;
+}
+
+uint16_t cpu_inw(pio_addr_t addr)
+{
+    x86emu_host_io_count++;
+    return 0xffff;
+}
+
+uint32_t cpu_inl(pio_addr_t addr)
+{
+    x86emu_host_io_count++;
+    return 0xffffffff;
+}
+
+void cpu_outb(pio_addr_t addr, uint8_t val)
+{
+    x86emu_host_io_count++;
+}
+
+void cpu_outw(pio_addr_t addr, uint16_t val)
+{
+    x86emu_host_io_count++;
+}
+
+void cpu_outl(pio_addr_t addr, uint32_t val)
+{
+    x86emu_host_io_count++;
+}
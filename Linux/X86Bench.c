@@ -0,0 +1,1013 @@
+/*
+ *  Benchmark runner for the Linux host build
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs x86-64 kernels through run_x86_func() and reports the guest
+ * instruction rate, an estimate of the translation time, the size of
+ * the generated code per translated guest instruction and the
+ * translation cache statistics.
+ *
+ * Each kernel is a loop that exercises one class of instructions. It
+ * takes its iteration count in RCX, a 4 KB scratch buffer in RDX and a
+ * native function in R8 (MS x64 calling convention), and returns a value
+ * in RAX that is checked against a C version of the same computation.
+ * The instruction counts below count a rep prefixed instruction once.
+ * Kernels that return to x86 code also report the hit rate of the return
+ * address stack (RAS).
+ *
+ * The "lookup" micro-benchmark then registers up to 64 x86 images and
+ * times image_index_find() through pc_is_native_call(), for an address in
+ * each image in turn and for a native one. The translator makes this
+ * lookup for each block it translates, and the driver for each entry
+ * through a trampoline.
+ *
+ * usage: x86bench [-c] [kernel...]
+ *
+ * -c prints the results as CSV, for tracking them across releases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "main.h"
+#include "X86EmulatorHost.h"
+
+#define SCRATCH_SIZE    4096
+#define IMAGE_SIZE      (64 * 1024)
+#define LOOKUP_IMAGES   64
+#define LOOKUP_COUNT    10000000
+
+typedef struct X86Kernel {
+    const char *name;
+    const uint8_t *code;
+    unsigned int size;
+    /* guest instructions executed per iteration */
+    unsigned int insns_per_iter;
+    /* near returns to x86 code per iteration, for the RAS hit rate */
+    unsigned int rets_per_iter;
+    uint64_t iters;
+    uint64_t (*expected)(uint64_t iters, const uint64_t *buf);
+} X86Kernel;
+
+/*
+ *     xor    eax,eax
+ * 1:  add    rax,rcx
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ */
+static const uint8_t code_sum[] = {
+    0x31, 0xc0,
+    0x48, 0x01, 0xc8,
+    0x48, 0xff, 0xc9,
+    0x75, 0xf8,
+    0xc3,
+};
+
+static uint64_t expected_sum(uint64_t iters, const uint64_t *buf)
+{
+    return iters * (iters + 1) / 2;
+}
+
+/*
+ *     xor    eax,eax
+ * 1:  mov    r9,rcx
+ *     and    r9,0x1ff
+ *     add    rax,QWORD PTR [rdx+r9*8]
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ */
+static const uint8_t code_memsum[] = {
+    0x31, 0xc0,
+    0x49, 0x89, 0xc9,
+    0x49, 0x81, 0xe1, 0xff, 0x01, 0x00, 0x00,
+    0x4a, 0x03, 0x04, 0xca,
+    0x48, 0xff, 0xc9,
+    0x75, 0xed,
+    0xc3,
+};
+
+static uint64_t expected_memsum(uint64_t iters, const uint64_t *buf)
+{
+    uint64_t r = 0;
+
+    for (; iters; iters--)
+        r += buf[iters & 511];
+    return r;
+}
+
+/* integer ALU with flags */
+
+/*
+ *     xor    eax,eax
+ *     mov    r9d,0x12345
+ *     xor    r10d,r10d
+ * 1:  add    rax,rcx
+ *     xor    rax,0x55
+ *     sub    rax,r9
+ *     cmp    rax,rcx
+ *     setb   r10b
+ *     add    rax,r10
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ */
+static const uint8_t code_alu[] = {
+    0x31, 0xc0,
+    0x41, 0xb9, 0x45, 0x23, 0x01, 0x00,
+    0x45, 0x31, 0xd2,
+    0x48, 0x01, 0xc8,
+    0x48, 0x83, 0xf0, 0x55,
+    0x4c, 0x29, 0xc8,
+    0x48, 0x39, 0xc8,
+    0x41, 0x0f, 0x92, 0xc2,
+    0x4c, 0x01, 0xd0,
+    0x48, 0xff, 0xc9,
+    0x75, 0xe7,
+    0xc3,
+};
+
+static uint64_t expected_alu(uint64_t iters, const uint64_t *buf)
+{
+    uint64_t r = 0;
+
+    for (; iters; iters--) {
+        r += iters;
+        r ^= 0x55;
+        r -= 0x12345;
+        r += r < iters;
+    }
+    return r;
+}
+
+/* adc/sbb chains */
+
+/*
+ *     xor    eax,eax
+ *     xor    r8d,r8d
+ *     xor    r9d,r9d
+ *     xor    r10d,r10d
+ *     xor    r11d,r11d
+ * 1:  add    r8,rcx
+ *     adc    r9,rax
+ *     adc    r10,r8
+ *     sbb    r11,r9
+ *     sbb    rax,r10
+ *     dec    rcx
+ *     jne    1b
+ *     add    rax,r11
+ *     ret
+ */
+static const uint8_t code_adc[] = {
+    0x31, 0xc0,
+    0x45, 0x31, 0xc0,
+    0x45, 0x31, 0xc9,
+    0x45, 0x31, 0xd2,
+    0x45, 0x31, 0xdb,
+    0x49, 0x01, 0xc8,
+    0x49, 0x11, 0xc1,
+    0x4d, 0x11, 0xc2,
+    0x4d, 0x19, 0xcb,
+    0x4c, 0x19, 0xd0,
+    0x48, 0xff, 0xc9,
+    0x75, 0xec,
+    0x4c, 0x01, 0xd8,
+    0xc3,
+};
+
+static uint64_t expected_adc(uint64_t iters, const uint64_t *buf)
+{
+    uint64_t a = 0, r8 = 0, r9 = 0, r10 = 0, r11 = 0, t;
+    int c;
+
+    for (; iters; iters--) {
+        r8 += iters;
+        c = r8 < iters;
+        t = r9 + a + c;
+        c = c ? t <= r9 : t < r9;
+        r9 = t;
+        t = r10 + r8 + c;
+        c = c ? t <= r10 : t < r10;
+        r10 = t;
+        t = r11 - r9 - c;
+        c = c ? r11 <= r9 : r11 < r9;
+        r11 = t;
+        a = a - r10 - c;
+    }
+    return a + r11;
+}
+
+/* mul/div */
+
+/*
+ *     xor    r10d,r10d
+ * 1:  mov    rax,rcx
+ *     mul    rcx
+ *     add    r10,rax
+ *     add    r10,rdx
+ *     mov    rax,r10
+ *     xor    edx,edx
+ *     div    rcx
+ *     add    r10,rdx
+ *     mov    rax,r10
+ *     cqo
+ *     idiv   rcx
+ *     add    r10,rax
+ *     imul   r10,r10,7
+ *     dec    rcx
+ *     jne    1b
+ *     mov    rax,r10
+ *     ret
+ */
+static const uint8_t code_muldiv[] = {
+    0x45, 0x31, 0xd2,
+    0x48, 0x89, 0xc8,
+    0x48, 0xf7, 0xe1,
+    0x49, 0x01, 0xc2,
+    0x49, 0x01, 0xd2,
+    0x4c, 0x89, 0xd0,
+    0x31, 0xd2,
+    0x48, 0xf7, 0xf1,
+    0x49, 0x01, 0xd2,
+    0x4c, 0x89, 0xd0,
+    0x48, 0x99,
+    0x48, 0xf7, 0xf9,
+    0x49, 0x01, 0xc2,
+    0x4d, 0x6b, 0xd2, 0x07,
+    0x48, 0xff, 0xc9,
+    0x75, 0xd5,
+    0x4c, 0x89, 0xd0,
+    0xc3,
+};
+
+static uint64_t expected_muldiv(uint64_t iters, const uint64_t *buf)
+{
+    uint64_t r = 0;
+    unsigned __int128 p;
+
+    for (; iters; iters--) {
+        p = (unsigned __int128)iters * iters;
+        r += (uint64_t)p;
+        r += (uint64_t)(p >> 64);
+        r += r % iters;
+        r += (int64_t)r / (int64_t)iters;
+        r *= 7;
+    }
+    return r;
+}
+
+/* shifts and rotates */
+
+/*
+ *     movabs rax,0x123456789abcdef0
+ * 1:  mov    r9,rax
+ *     shl    r9,cl
+ *     ror    rax,7
+ *     xor    rax,r9
+ *     rol    rax,cl
+ *     sar    r9,3
+ *     add    rax,r9
+ *     rcl    rax,1
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ */
+static const uint8_t code_shift[] = {
+    0x48, 0xb8, 0xf0, 0xde, 0xbc, 0x9a, 0x78, 0x56, 0x34, 0x12,
+    0x49, 0x89, 0xc1,
+    0x49, 0xd3, 0xe1,
+    0x48, 0xc1, 0xc8, 0x07,
+    0x4c, 0x31, 0xc8,
+    0x48, 0xd3, 0xc0,
+    0x49, 0xc1, 0xf9, 0x03,
+    0x4c, 0x01, 0xc8,
+    0x48, 0xd1, 0xd0,
+    0x48, 0xff, 0xc9,
+    0x75, 0xe1,
+    0xc3,
+};
+
+static uint64_t expected_shift(uint64_t iters, const uint64_t *buf)
+{
+    uint64_t r = 0x123456789abcdef0ULL, t, s;
+    int n;
+
+    for (; iters; iters--) {
+        n = iters & 63;
+        t = r << n;
+        r = (r >> 7) | (r << 57);
+        r ^= t;
+        if (n)
+            r = (r << n) | (r >> (64 - n));
+        t = (int64_t)t >> 3;
+        s = r + t;
+        r = (s << 1) | (s < r);
+    }
+    return r;
+}
+
+/* bit scans */
+
+/*
+ *     xor    eax,eax
+ *     movabs r10,0x9e3779b97f4a7c15
+ * 1:  mov    r9,rcx
+ *     imul   r9,r10
+ *     bsf    r11,r9
+ *     bsr    r8,r9
+ *     add    rax,r11
+ *     add    rax,r8
+ *     bt     r9,5
+ *     adc    rax,0
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ */
+static const uint8_t code_bitscan[] = {
+    0x31, 0xc0,
+    0x49, 0xba, 0x15, 0x7c, 0x4a, 0x7f, 0xb9, 0x79, 0x37, 0x9e,
+    0x49, 0x89, 0xc9,
+    0x4d, 0x0f, 0xaf, 0xca,
+    0x4d, 0x0f, 0xbc, 0xd9,
+    0x4d, 0x0f, 0xbd, 0xc1,
+    0x4c, 0x01, 0xd8,
+    0x4c, 0x01, 0xc0,
+    0x49, 0x0f, 0xba, 0xe1, 0x05,
+    0x48, 0x83, 0xd0, 0x00,
+    0x48, 0xff, 0xc9,
+    0x75, 0xdd,
+    0xc3,
+};
+
+static uint64_t expected_bitscan(uint64_t iters, const uint64_t *buf)
+{
+    uint64_t r = 0, x;
+
+    for (; iters; iters--) {
+        x = iters * 0x9e3779b97f4a7c15ULL;
+        r += __builtin_ctzll(x);
+        r += 63 - __builtin_clzll(x);
+        r += (x >> 5) & 1;
+    }
+    return r;
+}
+
+/* rep movs/stos/cmps */
+
+/*
+ *     push   rsi
+ *     push   rdi
+ *     mov    r9,rdx
+ *     mov    r10,rcx
+ *     xor    r11d,r11d
+ *     cld
+ * 1:  mov    rsi,r9
+ *     lea    rdi,[r9 + 2048]
+ *     mov    ecx,256
+ *     rep movsq
+ *     lea    rdi,[r9 + 3072]
+ *     mov    rax,r10
+ *     mov    ecx,512
+ *     rep stosb
+ *     mov    rsi,r9
+ *     lea    rdi,[r9 + 2048]
+ *     mov    ecx,2048
+ *     repe cmpsb
+ *     add    r11,rcx
+ *     dec    r10
+ *     jne    1b
+ *     mov    rax,r11
+ *     pop    rdi
+ *     pop    rsi
+ *     ret
+ */
+static const uint8_t code_string[] = {
+    0x56,
+    0x57,
+    0x49, 0x89, 0xd1,
+    0x49, 0x89, 0xca,
+    0x45, 0x31, 0xdb,
+    0xfc,
+    0x4c, 0x89, 0xce,
+    0x49, 0x8d, 0xb9, 0x00, 0x08, 0x00, 0x00,
+    0xb9, 0x00, 0x01, 0x00, 0x00,
+    0xf3, 0x48, 0xa5,
+    0x49, 0x8d, 0xb9, 0x00, 0x0c, 0x00, 0x00,
+    0x4c, 0x89, 0xd0,
+    0xb9, 0x00, 0x02, 0x00, 0x00,
+    0xf3, 0xaa,
+    0x4c, 0x89, 0xce,
+    0x49, 0x8d, 0xb9, 0x00, 0x08, 0x00, 0x00,
+    0xb9, 0x00, 0x08, 0x00, 0x00,
+    0xf3, 0xa6,
+    0x49, 0x01, 0xcb,
+    0x49, 0xff, 0xca,
+    0x75, 0xc4,
+    0x4c, 0x89, 0xd8,
+    0x5f,
+    0x5e,
+    0xc3,
+};
+
+static uint64_t expected_string(uint64_t iters, const uint64_t *buf)
+{
+    const uint8_t *src = (const uint8_t *)buf;
+    uint8_t copy[2048];
+    uint64_t r = 0;
+    int n;
+
+    for (; iters; iters--) {
+        memcpy(copy, src, 2048);
+        memset(copy + 1024, (uint8_t)iters, 512);
+        for (n = 0; n < 2048; n++) {
+            if (src[n] != copy[n])
+                break;
+        }
+        /* repe cmpsb decrements rcx for the mismatching byte too */
+        r += n < 2048 ? 2048 - n - 1 : 0;
+    }
+    return r;
+}
+
+/* SSE integer */
+
+typedef union {
+    uint64_t q[2];
+    uint32_t d[4];
+    uint16_t w[8];
+} XMMValue;
+
+/*
+ *     movdqu xmm0,[rdx]
+ *     movdqu xmm1,[rdx + 16]
+ *     pxor   xmm2,xmm2
+ * 1:  paddd  xmm0,xmm1
+ *     pxor   xmm1,xmm0
+ *     pshufd xmm1,xmm1,0x39
+ *     pmullw xmm0,xmm1
+ *     paddq  xmm2,xmm0
+ *     psrlq  xmm0,1
+ *     dec    rcx
+ *     jne    1b
+ *     movq   rax,xmm2
+ *     pshufd xmm2,xmm2,0x4e
+ *     movq   r9,xmm2
+ *     add    rax,r9
+ *     ret
+ */
+static const uint8_t code_sse_int[] = {
+    0xf3, 0x0f, 0x6f, 0x02,
+    0xf3, 0x0f, 0x6f, 0x4a, 0x10,
+    0x66, 0x0f, 0xef, 0xd2,
+    0x66, 0x0f, 0xfe, 0xc1,
+    0x66, 0x0f, 0xef, 0xc8,
+    0x66, 0x0f, 0x70, 0xc9, 0x39,
+    0x66, 0x0f, 0xd5, 0xc1,
+    0x66, 0x0f, 0xd4, 0xd0,
+    0x66, 0x0f, 0x73, 0xd0, 0x01,
+    0x48, 0xff, 0xc9,
+    0x75, 0xe1,
+    0x66, 0x48, 0x0f, 0x7e, 0xd0,
+    0x66, 0x0f, 0x70, 0xd2, 0x4e,
+    0x66, 0x49, 0x0f, 0x7e, 0xd1,
+    0x4c, 0x01, 0xc8,
+    0xc3,
+};
+
+static uint64_t expected_sse_int(uint64_t iters, const uint64_t *buf)
+{
+    XMMValue x0, x1, x2, t;
+    int i;
+
+    memcpy(&x0, buf, 16);
+    memcpy(&x1, buf + 2, 16);
+    x2.q[0] = x2.q[1] = 0;
+    for (; iters; iters--) {
+        for (i = 0; i < 4; i++)
+            x0.d[i] += x1.d[i];
+        for (i = 0; i < 4; i++)
+            t.d[i] = x1.d[i] ^ x0.d[i];
+        for (i = 0; i < 4; i++)
+            x1.d[i] = t.d[(i + 1) & 3];
+        for (i = 0; i < 8; i++)
+            x0.w[i] *= x1.w[i];
+        for (i = 0; i < 2; i++) {
+            x2.q[i] += x0.q[i];
+            x0.q[i] >>= 1;
+        }
+    }
+    return x2.q[0] + x2.q[1];
+}
+
+/* SSE float */
+
+/*
+ *     xorpd  xmm2,xmm2
+ *     mov    r9,3
+ *     cvtsi2sd xmm1,r9
+ * 1:  cvtsi2sd xmm0,rcx
+ *     addsd  xmm2,xmm0
+ *     sqrtsd xmm3,xmm0
+ *     divsd  xmm3,xmm1
+ *     subsd  xmm2,xmm3
+ *     dec    rcx
+ *     jne    1b
+ *     cvttsd2si rax,xmm2
+ *     ret
+ */
+static const uint8_t code_sse_float[] = {
+    0x66, 0x0f, 0x57, 0xd2,
+    0x49, 0xc7, 0xc1, 0x03, 0x00, 0x00, 0x00,
+    0xf2, 0x49, 0x0f, 0x2a, 0xc9,
+    0xf2, 0x48, 0x0f, 0x2a, 0xc1,
+    0xf2, 0x0f, 0x58, 0xd0,
+    0xf2, 0x0f, 0x51, 0xd8,
+    0xf2, 0x0f, 0x5e, 0xd9,
+    0xf2, 0x0f, 0x5c, 0xd3,
+    0x48, 0xff, 0xc9,
+    0x75, 0xe6,
+    0xf2, 0x48, 0x0f, 0x2c, 0xc2,
+    0xc3,
+};
+
+static uint64_t expected_sse_float(uint64_t iters, const uint64_t *buf)
+{
+    double s = 0, x;
+
+    for (; iters; iters--) {
+        x = (double)(int64_t)iters;
+        s += x;
+        s -= sqrt(x) / 3.0;
+    }
+    return (int64_t)s;
+}
+
+/* x87 */
+
+/*
+ *     fldz
+ * 1:  mov    [rdx + 8],rcx
+ *     fild   qword ptr [rdx + 8]
+ *     fadd   st(0),st(0)
+ *     fchs
+ *     fsubp  st(1),st(0)
+ *     dec    rcx
+ *     jne    1b
+ *     fistp  qword ptr [rdx + 8]
+ *     mov    rax,[rdx + 8]
+ *     ret
+ */
+static const uint8_t code_x87[] = {
+    0xd9, 0xee,
+    0x48, 0x89, 0x4a, 0x08,
+    0xdf, 0x6a, 0x08,
+    0xd8, 0xc0,
+    0xd9, 0xe0,
+    0xde, 0xe9,
+    0x48, 0xff, 0xc9,
+    0x75, 0xee,
+    0xdf, 0x7a, 0x08,
+    0x48, 0x8b, 0x42, 0x08,
+    0xc3,
+};
+
+static uint64_t expected_x87(uint64_t iters, const uint64_t *buf)
+{
+    return iters * (iters + 1);
+}
+
+/* string I/O */
+
+/*
+ *     push   rsi
+ *     push   rdi
+ *     mov    r9,rdx
+ *     mov    r10,rcx
+ *     xor    r11d,r11d
+ *     mov    edx,0x80
+ *     cld
+ * 1:  lea    rdi,[r9 + 2048]
+ *     mov    ecx,64
+ *     rep insb
+ *     mov    rsi,r9
+ *     mov    ecx,64
+ *     rep outsb
+ *     xor    eax,eax
+ *     in     al,dx
+ *     add    r11,rax
+ *     dec    r10
+ *     jne    1b
+ *     mov    rax,r11
+ *     pop    rdi
+ *     pop    rsi
+ *     ret
+ */
+static const uint8_t code_pio[] = {
+    0x56,
+    0x57,
+    0x49, 0x89, 0xd1,
+    0x49, 0x89, 0xca,
+    0x45, 0x31, 0xdb,
+    0xba, 0x80, 0x00, 0x00, 0x00,
+    0xfc,
+    0x49, 0x8d, 0xb9, 0x00, 0x08, 0x00, 0x00,
+    0xb9, 0x40, 0x00, 0x00, 0x00,
+    0xf3, 0x6c,
+    0x4c, 0x89, 0xce,
+    0xb9, 0x40, 0x00, 0x00, 0x00,
+    0xf3, 0x6e,
+    0x31, 0xc0,
+    0xec,
+    0x49, 0x01, 0xc3,
+    0x49, 0xff, 0xca,
+    0x75, 0xdd,
+    0x4c, 0x89, 0xd8,
+    0x5f,
+    0x5e,
+    0xc3,
+};
+
+static uint64_t expected_pio(uint64_t iters, const uint64_t *buf)
+{
+    /* the host build has no devices, reads return all ones */
+    return iters * 0xff;
+}
+
+/* indirect calls, to x86 and to native code */
+
+/*
+ *     xor    eax,eax
+ *     lea    r10,[rip + 2f]
+ * 1:  call   r10
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ * 2:  add    rax,rcx
+ *     ret
+ */
+static const uint8_t code_icall[] = {
+    0x31, 0xc0,
+    0x4c, 0x8d, 0x15, 0x09, 0x00, 0x00, 0x00,
+    0x41, 0xff, 0xd2,
+    0x48, 0xff, 0xc9,
+    0x75, 0xf8,
+    0xc3,
+    0x48, 0x01, 0xc8,
+    0xc3,
+};
+
+static uint64_t expected_icall(uint64_t iters, const uint64_t *buf)
+{
+    return iters * (iters + 1) / 2;
+}
+
+/* call chain of depth 8, within reach of the return address stack */
+
+/*
+ *     xor    eax,eax
+ * 1:  mov    r9d,8
+ *     call   2f
+ *     dec    rcx
+ *     jne    1b
+ *     ret
+ * 2:  add    rax,rcx
+ *     dec    r9
+ *     je     3f
+ *     call   2b
+ * 3:  ret
+ */
+static const uint8_t code_calls[] = {
+    0x31, 0xc0,
+    0x41, 0xb9, 0x08, 0x00, 0x00, 0x00,
+    0xe8, 0x06, 0x00, 0x00, 0x00,
+    0x48, 0xff, 0xc9,
+    0x75, 0xf0,
+    0xc3,
+    0x48, 0x01, 0xc8,
+    0x49, 0xff, 0xc9,
+    0x74, 0x05,
+    0xe8, 0xf3, 0xff, 0xff, 0xff,
+    0xc3,
+};
+
+static uint64_t expected_calls(uint64_t iters, const uint64_t *buf)
+{
+    return 8 * (iters * (iters + 1) / 2);
+}
+
+static uint64_t native_double(uint64_t x)
+{
+    return x * 2;
+}
+
+/*
+ *     push   rbx
+ *     push   rsi
+ *     push   rdi
+ *     sub    rsp,32
+ *     mov    rbx,rcx
+ *     mov    rsi,r8
+ *     xor    edi,edi
+ * 1:  mov    rcx,rbx
+ *     call   rsi
+ *     add    rdi,rax
+ *     dec    rbx
+ *     jne    1b
+ *     mov    rax,rdi
+ *     add    rsp,32
+ *     pop    rdi
+ *     pop    rsi
+ *     pop    rbx
+ *     ret
+ */
+static const uint8_t code_native[] = {
+    0x53,
+    0x56,
+    0x57,
+    0x48, 0x83, 0xec, 0x20,
+    0x48, 0x89, 0xcb,
+    0x4c, 0x89, 0xc6,
+    0x31, 0xff,
+    0x48, 0x89, 0xd9,
+    0xff, 0xd6,
+    0x48, 0x01, 0xc7,
+    0x48, 0xff, 0xcb,
+    0x75, 0xf3,
+    0x48, 0x89, 0xf8,
+    0x48, 0x83, 0xc4, 0x20,
+    0x5f,
+    0x5e,
+    0x5b,
+    0xc3,
+};
+
+static uint64_t expected_native(uint64_t iters, const uint64_t *buf)
+{
+    return iters * (iters + 1);
+}
+
+#define KERNEL(name, insns_per_iter, rets_per_iter, iters) \
+    { #name, code_##name, sizeof(code_##name), insns_per_iter, \
+      rets_per_iter, iters, expected_##name }
+
+static const X86Kernel kernels[] = {
+    KERNEL(sum, 3, 0, 10000000),
+    KERNEL(memsum, 5, 0, 10000000),
+    KERNEL(alu, 8, 0, 10000000),
+    KERNEL(adc, 7, 0, 10000000),
+    KERNEL(muldiv, 15, 0, 1000000),
+    KERNEL(shift, 10, 0, 10000000),
+    KERNEL(bitscan, 10, 0, 10000000),
+    KERNEL(string, 15, 0, 20000),
+    KERNEL(sse_int, 8, 0, 1000000),
+    KERNEL(sse_float, 7, 0, 1000000),
+    KERNEL(x87, 7, 0, 1000000),
+    KERNEL(pio, 11, 0, 20000),
+    KERNEL(icall, 5, 1, 10000000),
+    KERNEL(calls, 43, 8, 1000000),
+    KERNEL(native, 5, 0, 1000000),
+};
+
+static uint64_t run_kernel(void *code, uint64_t iters, uint64_t *buf)
+{
+    uint64_t args[3] = { iters, (uintptr_t)buf, (uintptr_t)native_double };
+
+    return run_x86_func(code, args, 3);
+}
+
+/* host code generated and guest instructions translated so far */
+static void translated_code(int64_t *out_len, int64_t *insns)
+{
+    int i;
+
+    *out_len = 0;
+    *insns = 0;
+    for (i = 0; i < TCG_TIER_COUNT; i++) {
+        *out_len += tcg_ctx.tier_code_out_len[i];
+        *insns += tcg_ctx.tier_insn_count[i];
+    }
+}
+
+static int kernel_selected(const char *name, int argc, char **argv)
+{
+    int i;
+
+    if (argc == 0)
+        return 1;
+    for (i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], name))
+            return 1;
+    }
+    return 0;
+}
+
+/* time pc_is_native_call(), which looks up the ImageIndex.c index like
+   FindImageRecord() does, with 1 to LOOKUP_IMAGES registered images,
+   'image' being the one already registered for the kernels */
+static int bench_lookup(uint8_t *image, int csv)
+{
+    uint64_t pcs[LOOKUP_IMAGES];
+    uint64_t ns, native_ns, native;
+    long page_size = getpagesize();
+    size_t pages_size = 2 * LOOKUP_IMAGES * page_size;
+    uint8_t *pages;
+    int n, nb_images, i, j, ret = 1;
+
+    /* one page images with a gap between them, so that the addresses
+       in between are native */
+    pages = mmap(NULL, pages_size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pages == MAP_FAILED)
+        return 1;
+
+    if (csv)
+        printf("\nimages,ns_per_lookup,ns_per_native_lookup\n");
+    else
+        printf("\n%-10s %12s %12s\n", "images", "ns/lookup",
+               "ns/native");
+    pcs[0] = (uintptr_t)image;
+    nb_images = 1;
+    for (n = 1; n <= LOOKUP_IMAGES; n *= 2) {
+        for (; nb_images < n; nb_images++) {
+            pcs[nb_images] = (uintptr_t)(pages + 2 * nb_images * page_size);
+            if (x86emu_host_add_image((void *)(uintptr_t)pcs[nb_images],
+                                      page_size, 0))
+                goto out;
+        }
+
+        /* a different image each time, so that the binary search does
+           not always take the same path */
+        native = 0;
+        ns = GetPerformanceCounter();
+        for (i = 0, j = 0; i < LOOKUP_COUNT; i++) {
+            native += pc_is_native_call(pcs[j]);
+            if (++j == n)
+                j = 0;
+        }
+        ns = GetPerformanceCounter() - ns;
+
+        native_ns = GetPerformanceCounter();
+        for (i = 0; i < LOOKUP_COUNT; i++)
+            native += pc_is_native_call((uintptr_t)pages + page_size);
+        native_ns = GetPerformanceCounter() - native_ns;
+
+        if (native != LOOKUP_COUNT)
+            goto out;
+        if (csv)
+            printf("%d,%.2f,%.2f\n", n, (double)ns / LOOKUP_COUNT,
+                   (double)native_ns / LOOKUP_COUNT);
+        else
+            printf("%-10d %12.2f %12.2f\n", n,
+                   (double)ns / LOOKUP_COUNT,
+                   (double)native_ns / LOOKUP_COUNT);
+    }
+    ret = 0;
+out:
+    /* the images stay registered, but nothing runs in them */
+    munmap(pages, pages_size);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *image, *code;
+    uint64_t *buf;
+    uint64_t t0, t1, t2, ns, insns, r, ras_misses;
+    int64_t helpers, out_len, tb_insns, out_len1, tb_insns1;
+    double bytes_per_insn;
+    char ras[16];
+    unsigned int i, offset;
+    int csv = 0, tbs, ok, failed = 0;
+
+    argc--;
+    argv++;
+    if (argc > 0 && !strcmp(argv[0], "-c")) {
+        csv = 1;
+        argc--;
+        argv++;
+    }
+
+    if (x86emu_host_init() || x86emu_init(CODE_GEN_BUFFER_SIZE)) {
+        fprintf(stderr, "failed to initialize the emulator\n");
+        return 1;
+    }
+
+    image = mmap(NULL, IMAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf = malloc(SCRATCH_SIZE);
+    if (image == MAP_FAILED || !buf) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < SCRATCH_SIZE / sizeof(*buf); i++)
+        buf[i] = i * 0x9e3779b97f4a7c15ULL;
+
+    offset = 0;
+    for (i = 0; i < ARRAY_SIZE(kernels); i++) {
+        memcpy(image + offset, kernels[i].code, kernels[i].size);
+        offset = (offset + kernels[i].size + 15) & ~15;
+    }
+    x86emu_host_add_image(image, IMAGE_SIZE, 1);
+    x86emu_host_add_native(native_double, 1);
+
+    if (csv)
+        printf("kernel,iterations,guest_insns,ns,ns_per_insn,translate_us,"
+               "tbs,host_bytes_per_insn,helper_calls,ras_hit_pct,result\n");
+    else
+        printf("%-10s %12s %12s %8s %12s %6s %7s %8s %6s\n", "kernel",
+               "guest insns", "ns", "ns/insn", "translate us", "TBs",
+               "B/insn", "helpers", "RAS %");
+    offset = 0;
+    for (i = 0; i < ARRAY_SIZE(kernels); i++) {
+        code = image + offset;
+        offset = (offset + kernels[i].size + 15) & ~15;
+        if (!kernel_selected(kernels[i].name, argc, argv))
+            continue;
+
+        /* a single iteration with a cold, then a warm cache tells the
+           cost of translating the kernel */
+        tb_flush(first_cpu);
+        tbs = tb_gen_count;
+        helpers = tcg_ctx.helper_call_count;
+        translated_code(&out_len, &tb_insns);
+        t0 = GetPerformanceCounter();
+        run_kernel(code, 1, buf);
+        t1 = GetPerformanceCounter();
+        run_kernel(code, 1, buf);
+        t2 = GetPerformanceCounter();
+
+        ras_misses = first_cpu->ras_miss_count;
+        ns = GetPerformanceCounter();
+        r = run_kernel(code, kernels[i].iters, buf);
+        ns = GetPerformanceCounter() - ns;
+        tbs = tb_gen_count - tbs;
+        helpers = tcg_ctx.helper_call_count - helpers;
+        /* every block of the kernel, including the traces */
+        translated_code(&out_len1, &tb_insns1);
+        bytes_per_insn = tb_insns1 > tb_insns ?
+                         (double)(out_len1 - out_len) / (tb_insns1 - tb_insns) :
+                         0;
+        ras_misses = first_cpu->ras_miss_count - ras_misses;
+
+        /* returns that missed the prediction, out of those executed */
+        if (kernels[i].rets_per_iter)
+            snprintf(ras, sizeof(ras), "%.1f", 100.0 -
+                     100.0 * ras_misses /
+                     (kernels[i].iters * kernels[i].rets_per_iter));
+        else
+            snprintf(ras, sizeof(ras), csv ? "" : "-");
+
+        insns = kernels[i].iters * kernels[i].insns_per_iter;
+        ok = r == kernels[i].expected(kernels[i].iters, buf);
+        if (!ok)
+            failed = 1;
+        if (csv)
+            printf("%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.3f,%.1f,%d,%.1f,%"
+                   PRId64 ",%s,%s\n",
+                   kernels[i].name, kernels[i].iters, insns, ns,
+                   (double)ns / insns,
+                   ((double)(t1 - t0) - (double)(t2 - t1)) / 1000.0,
+                   tbs, bytes_per_insn, helpers, ras, ok ? "ok" : "wrong");
+        else
+            printf("%-10s %12" PRIu64 " %12" PRIu64 " %8.2f %12.1f %6d %7.1f %8"
+                   PRId64 " %6s%s\n",
+                   kernels[i].name, insns, ns, (double)ns / insns,
+                   ((double)(t1 - t0) - (double)(t2 - t1)) / 1000.0,
+                   tbs, bytes_per_insn, helpers, ras,
+                   ok ? "" : "  WRONG RESULT");
+    }
+
+    if (kernel_selected("lookup", argc, argv) &&
+        bench_lookup(image, csv)) {
+        fprintf(stderr, "lookup benchmark failed\n");
+        failed = 1;
+    }
+
+    if (!csv) {
+        printf("\n");
+        dump_exec_info(stdout, fprintf);
+    }
+    return failed;
+}
@@ -0,0 +1,69 @@
+/*
+ *  QEMU Emulator glue, Linux host build
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stand-ins for the UEFI services that main.c and cpu-exec.c use, so that
+ * the emulator core can be built as a Linux user space program when
+ * X86EMU_HOST_BUILD is defined. See Linux/HostGlue.c.
+ */
+
+#ifndef __X86_EMULATOR_HOST_H__
+#define __X86_EMULATOR_HOST_H__
+
+#include <stdint.h>
+#include <assert.h>
+
+typedef uintptr_t EFI_TPL;
+
+#define TPL_APPLICATION     4
+#define TPL_NOTIFY          16
+
+/* only the services used by the emulator core */
+typedef struct {
+    EFI_TPL (*RaiseTPL)(EFI_TPL new_tpl);
+    void (*RestoreTPL)(EFI_TPL old_tpl);
+} EFI_BOOT_SERVICES;
+
+extern EFI_BOOT_SERVICES *gBS;
+
+#define EFI_UNSUPPORTED     0x8000000000000003ULL
+
+#ifndef FALSE
+#define FALSE               0
+#endif
+#define ASSERT(x)           assert(x)
+
+void CpuSleep(void);
+/* in nanoseconds */
+uint64_t GetPerformanceCounter(void);
+
+/* ceiling on the code buffer, whose regions are mapped as needed */
+#define CODE_GEN_BUFFER_SIZE    (32 * 1024 * 1024)
+
+void dump_x86_state(void);
+
+/* map the code prologue, to be called before x86emu_init() */
+int x86emu_host_init(void);
+/* declare [base, base + size[ as x86 code, see pc_is_native_call() */
+int x86emu_host_add_image(void *base, unsigned long size, int immutable);
+/* make 'func' callable from x86 code with 'nargs' arguments */
+int x86emu_host_add_native(void *func, int nargs);
+
+/* number of port I/O accesses made by the x86 code */
+extern uint64_t x86emu_host_io_count;
+
+#endif
@@ -0,0 +1,388 @@
+//
+// Copyright (c) 2017, Linaro, Ltd. <ard.biesheuvel@linaro.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+
+#include "X86Emulator.h"
+
+#include <Library/BaseMemoryLib.h>
+
+#include <Protocol/DriverBinding.h>
+#include <Protocol/SimpleTextIn.h>
+#include <Protocol/SimpleTextOut.h>
+
+typedef struct {
+  UINTN     Offset;
+  UINT8     ArgCount;
+  VOID      *Wrapper;
+} NATIVE_CALL_SLOT;
+
+typedef struct {
+  UINTN     Function;
+  UINTN     ArgCount;
+  VOID      *Wrapper;
+} NATIVE_CALL_SIGNATURE;
+
+#define SLOT(Type, Member, Count)   { OFFSET_OF (Type, Member), Count, NULL }
+
+#define WRAPPED_SLOT(Type, Member, Count, Wrapper) \
+  { OFFSET_OF (Type, Member), Count, (VOID *)Wrapper }
+
+STATIC EFI_CREATE_EVENT                           mCreateEvent;
+STATIC EFI_CREATE_EVENT_EX                        mCreateEventEx;
+STATIC EFI_INSTALL_PROTOCOL_INTERFACE             mInstallProtocolInterface;
+STATIC EFI_INSTALL_MULTIPLE_PROTOCOL_INTERFACES   mInstallMultipleProtocolInterfaces;
+
+//
+// Map a function pointer that x86 code hands to the firmware onto a native
+// trampoline, so that the firmware calling it does not take an instruction
+// abort each time.
+//
+STATIC
+UINT64
+ToNativeFunction (
+  IN  UINT64    Function
+  )
+{
+  if (Function == 0 ||
+      FindImageRecord ((EFI_PHYSICAL_ADDRESS)Function) == NULL) {
+    return Function;
+  }
+  return X86EmulatorGetTrampoline (Function);
+}
+
+STATIC
+VOID
+PatchDriverBinding (
+  IN  CONST EFI_GUID    *Guid,
+  IN  VOID              *Interface
+  )
+{
+  EFI_DRIVER_BINDING_PROTOCOL   *DriverBinding;
+
+  if (Guid == NULL || Interface == NULL ||
+      !CompareGuid (Guid, &gEfiDriverBindingProtocolGuid)) {
+    return;
+  }
+
+  DriverBinding = Interface;
+  DriverBinding->Supported = (EFI_DRIVER_BINDING_SUPPORTED)(UINTN)
+    ToNativeFunction ((UINT64)(UINTN)DriverBinding->Supported);
+  DriverBinding->Start = (EFI_DRIVER_BINDING_START)(UINTN)
+    ToNativeFunction ((UINT64)(UINTN)DriverBinding->Start);
+  DriverBinding->Stop = (EFI_DRIVER_BINDING_STOP)(UINTN)
+    ToNativeFunction ((UINT64)(UINTN)DriverBinding->Stop);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+X86CreateEvent (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction  OPTIONAL,
+  IN  VOID              *NotifyContext  OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  NotifyFunction = (EFI_EVENT_NOTIFY)(UINTN)
+    ToNativeFunction ((UINT64)(UINTN)NotifyFunction);
+
+  return mCreateEvent (Type, NotifyTpl, NotifyFunction, NotifyContext, Event);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+X86CreateEventEx (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction  OPTIONAL,
+  IN  CONST VOID        *NotifyContext  OPTIONAL,
+  IN  CONST EFI_GUID    *EventGroup     OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  NotifyFunction = (EFI_EVENT_NOTIFY)(UINTN)
+    ToNativeFunction ((UINT64)(UINTN)NotifyFunction);
+
+  return mCreateEventEx (Type, NotifyTpl, NotifyFunction, NotifyContext,
+           EventGroup, Event);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+X86InstallProtocolInterface (
+  IN OUT EFI_HANDLE         *Handle,
+  IN     EFI_GUID           *Protocol,
+  IN     EFI_INTERFACE_TYPE InterfaceType,
+  IN     VOID               *Interface
+  )
+{
+  PatchDriverBinding (Protocol, Interface);
+
+  return mInstallProtocolInterface (Handle, Protocol, InterfaceType,
+           Interface);
+}
+
+//
+// InstallMultipleProtocolInterfaces () is variadic, but under AAPCS64 its
+// arguments are passed exactly like those of this fixed prototype.
+//
+STATIC
+EFI_STATUS
+EFIAPI
+X86InstallMultipleProtocolInterfaces (
+  IN OUT EFI_HANDLE         *Handle,
+  IN     UINT64             A1,
+  IN     UINT64             A2,
+  IN     UINT64             A3,
+  IN     UINT64             A4,
+  IN     UINT64             A5,
+  IN     UINT64             A6,
+  IN     UINT64             A7,
+  IN     UINT64             A8,
+  IN     UINT64             A9,
+  IN     UINT64             A10,
+  IN     UINT64             A11,
+  IN     UINT64             A12,
+  IN     UINT64             A13,
+  IN     UINT64             A14,
+  IN     UINT64             A15
+  )
+{
+  UINT64    Args[] = { A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11, A12,
+                       A13, A14, A15 };
+  UINTN     Index;
+
+  for (Index = 0; Index + 1 < ARRAY_SIZE (Args) && Args[Index] != 0;
+       Index += 2) {
+    PatchDriverBinding ((EFI_GUID *)(UINTN)Args[Index],
+      (VOID *)(UINTN)Args[Index + 1]);
+  }
+
+  return mInstallMultipleProtocolInterfaces (Handle, A1, A2, A3, A4, A5, A6,
+           A7, A8, A9, A10, A11, A12, A13, A14, A15);
+}
+
+//
+// Argument counts of the services that x86 drivers call most often. The
+// services that take x86 callbacks are routed through a wrapper that hands
+// the firmware a native trampoline instead.
+//
+STATIC CONST NATIVE_CALL_SLOT mBootServicesSlots[] = {
+  SLOT (EFI_BOOT_SERVICES, RaiseTPL,                   1),
+  SLOT (EFI_BOOT_SERVICES, RestoreTPL,                 1),
+  SLOT (EFI_BOOT_SERVICES, AllocatePages,              4),
+  SLOT (EFI_BOOT_SERVICES, FreePages,                  2),
+  SLOT (EFI_BOOT_SERVICES, GetMemoryMap,               5),
+  SLOT (EFI_BOOT_SERVICES, AllocatePool,               3),
+  SLOT (EFI_BOOT_SERVICES, FreePool,                   1),
+  WRAPPED_SLOT (EFI_BOOT_SERVICES, CreateEvent,        5, X86CreateEvent),
+  SLOT (EFI_BOOT_SERVICES, SetTimer,                   3),
+  SLOT (EFI_BOOT_SERVICES, WaitForEvent,               3),
+  SLOT (EFI_BOOT_SERVICES, SignalEvent,                1),
+  SLOT (EFI_BOOT_SERVICES, CloseEvent,                 1),
+  SLOT (EFI_BOOT_SERVICES, CheckEvent,                 1),
+  WRAPPED_SLOT (EFI_BOOT_SERVICES, InstallProtocolInterface, 4,
+    X86InstallProtocolInterface),
+  SLOT (EFI_BOOT_SERVICES, ReinstallProtocolInterface, 4),
+  SLOT (EFI_BOOT_SERVICES, UninstallProtocolInterface, 3),
+  SLOT (EFI_BOOT_SERVICES, HandleProtocol,             3),
+  SLOT (EFI_BOOT_SERVICES, RegisterProtocolNotify,     3),
+  SLOT (EFI_BOOT_SERVICES, LocateHandle,               5),
+  SLOT (EFI_BOOT_SERVICES, LocateDevicePath,           3),
+  SLOT (EFI_BOOT_SERVICES, InstallConfigurationTable,  2),
+  SLOT (EFI_BOOT_SERVICES, LoadImage,                  6),
+  SLOT (EFI_BOOT_SERVICES, StartImage,                 3),
+  SLOT (EFI_BOOT_SERVICES, Exit,                       4),
+  SLOT (EFI_BOOT_SERVICES, UnloadImage,                1),
+  SLOT (EFI_BOOT_SERVICES, ExitBootServices,           2),
+  SLOT (EFI_BOOT_SERVICES, GetNextMonotonicCount,      1),
+  SLOT (EFI_BOOT_SERVICES, Stall,                      1),
+  SLOT (EFI_BOOT_SERVICES, SetWatchdogTimer,           4),
+  SLOT (EFI_BOOT_SERVICES, ConnectController,          4),
+  SLOT (EFI_BOOT_SERVICES, DisconnectController,       3),
+  SLOT (EFI_BOOT_SERVICES, OpenProtocol,               6),
+  SLOT (EFI_BOOT_SERVICES, CloseProtocol,              4),
+  SLOT (EFI_BOOT_SERVICES, OpenProtocolInformation,    4),
+  SLOT (EFI_BOOT_SERVICES, ProtocolsPerHandle,         3),
+  SLOT (EFI_BOOT_SERVICES, LocateHandleBuffer,         5),
+  SLOT (EFI_BOOT_SERVICES, LocateProtocol,             3),
+  SLOT (EFI_BOOT_SERVICES, CalculateCrc32,             3),
+  SLOT (EFI_BOOT_SERVICES, CopyMem,                    3),
+  SLOT (EFI_BOOT_SERVICES, SetMem,                     3),
+  WRAPPED_SLOT (EFI_BOOT_SERVICES, CreateEventEx,      6, X86CreateEventEx),
+  WRAPPED_SLOT (EFI_BOOT_SERVICES, InstallMultipleProtocolInterfaces, 16,
+    X86InstallMultipleProtocolInterfaces),
+};
+
+STATIC CONST NATIVE_CALL_SLOT mRuntimeServicesSlots[] = {
+  SLOT (EFI_RUNTIME_SERVICES, GetTime,                   2),
+  SLOT (EFI_RUNTIME_SERVICES, SetTime,                   1),
+  SLOT (EFI_RUNTIME_SERVICES, GetWakeupTime,             3),
+  SLOT (EFI_RUNTIME_SERVICES, SetWakeupTime,             2),
+  SLOT (EFI_RUNTIME_SERVICES, SetVirtualAddressMap,      4),
+  SLOT (EFI_RUNTIME_SERVICES, ConvertPointer,            2),
+  SLOT (EFI_RUNTIME_SERVICES, GetVariable,               5),
+  SLOT (EFI_RUNTIME_SERVICES, GetNextVariableName,       3),
+  SLOT (EFI_RUNTIME_SERVICES, SetVariable,               5),
+  SLOT (EFI_RUNTIME_SERVICES, GetNextHighMonotonicCount, 1),
+  SLOT (EFI_RUNTIME_SERVICES, ResetSystem,               4),
+  SLOT (EFI_RUNTIME_SERVICES, UpdateCapsule,             3),
+  SLOT (EFI_RUNTIME_SERVICES, QueryCapsuleCapabilities,  4),
+  SLOT (EFI_RUNTIME_SERVICES, QueryVariableInfo,         4),
+};
+
+STATIC CONST NATIVE_CALL_SLOT mSimpleTextOutSlots[] = {
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, Reset,             2),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, OutputString,      2),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, TestString,        2),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, QueryMode,         4),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, SetMode,           2),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, SetAttribute,      2),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, ClearScreen,       1),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, SetCursorPosition, 3),
+  SLOT (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL, EnableCursor,      2),
+};
+
+STATIC CONST NATIVE_CALL_SLOT mSimpleTextInSlots[] = {
+  SLOT (EFI_SIMPLE_TEXT_INPUT_PROTOCOL, Reset,         2),
+  SLOT (EFI_SIMPLE_TEXT_INPUT_PROTOCOL, ReadKeyStroke, 2),
+};
+
+//
+// Known native functions, sorted by address
+//
+STATIC NATIVE_CALL_SIGNATURE      *mSignatures;
+STATIC UINTN                      mSignatureCount;
+
+STATIC
+VOID
+AddSignature (
+  IN  UINTN     Function,
+  IN  UINTN     ArgCount,
+  IN  VOID      *Wrapper
+  )
+{
+  UINTN         Index;
+
+  if (Function == 0) {
+    return;
+  }
+
+  for (Index = mSignatureCount; Index > 0; Index--) {
+    if (mSignatures[Index - 1].Function < Function) {
+      break;
+    }
+    if (mSignatures[Index - 1].Function == Function) {
+      //
+      // Several members share an implementation: the widest one wins
+      //
+      mSignatures[Index - 1].ArgCount = MAX (mSignatures[Index - 1].ArgCount,
+                                             ArgCount);
+      if (mSignatures[Index - 1].Wrapper == NULL) {
+        mSignatures[Index - 1].Wrapper = Wrapper;
+      }
+      return;
+    }
+  }
+
+  CopyMem (&mSignatures[Index + 1], &mSignatures[Index],
+    (mSignatureCount - Index) * sizeof *mSignatures);
+  mSignatures[Index].Function = Function;
+  mSignatures[Index].ArgCount = ArgCount;
+  mSignatures[Index].Wrapper = Wrapper;
+  mSignatureCount++;
+}
+
+STATIC
+VOID
+AddSignatures (
+  IN  CONST VOID              *Table,
+  IN  CONST NATIVE_CALL_SLOT  *Slots,
+  IN  UINTN                   SlotCount
+  )
+{
+  UINTN                       Index;
+
+  if (Table == NULL) {
+    return;
+  }
+
+  for (Index = 0; Index < SlotCount; Index++) {
+    AddSignature (*(UINTN *)((UINT8 *)Table + Slots[Index].Offset),
+      Slots[Index].ArgCount, Slots[Index].Wrapper);
+  }
+}
+
+VOID
+InitializeNativeCallSignatures (
+  VOID
+  )
+{
+  mSignatures = AllocatePool ((ARRAY_SIZE (mBootServicesSlots) +
+                               ARRAY_SIZE (mRuntimeServicesSlots) +
+                               2 * ARRAY_SIZE (mSimpleTextOutSlots) +
+                               ARRAY_SIZE (mSimpleTextInSlots)) *
+                              sizeof *mSignatures);
+  if (mSignatures == NULL) {
+    return;
+  }
+
+  mCreateEvent = gBS->CreateEvent;
+  mCreateEventEx = gBS->CreateEventEx;
+  mInstallProtocolInterface = gBS->InstallProtocolInterface;
+  mInstallMultipleProtocolInterfaces = gBS->InstallMultipleProtocolInterfaces;
+
+  AddSignatures (gBS, mBootServicesSlots, ARRAY_SIZE (mBootServicesSlots));
+  AddSignatures (gST->RuntimeServices, mRuntimeServicesSlots,
+    ARRAY_SIZE (mRuntimeServicesSlots));
+  AddSignatures (gST->ConOut, mSimpleTextOutSlots,
+    ARRAY_SIZE (mSimpleTextOutSlots));
+  AddSignatures (gST->StdErr, mSimpleTextOutSlots,
+    ARRAY_SIZE (mSimpleTextOutSlots));
+  AddSignatures (gST->ConIn, mSimpleTextInSlots,
+    ARRAY_SIZE (mSimpleTextInSlots));
+}
+
+//
+// Resolve the function to call and the number of arguments to marshal for
+// a call from x86 code to the native function at Pc. This is done when the
+// call stub is translated, so the lookup is not on the hot path.
+//
+UINT64
+native_call_target (
+  IN  UINT64    Pc,
+  OUT INT32     *ArgCount
+  )
+{
+  UINTN         Low;
+  UINTN         High;
+  UINTN         Mid;
+
+  Low = 0;
+  High = mSignatureCount;
+  while (Low < High) {
+    Mid = Low + (High - Low) / 2;
+
+    if (Pc < mSignatures[Mid].Function) {
+      High = Mid;
+    } else if (Pc > mSignatures[Mid].Function) {
+      Low = Mid + 1;
+    } else {
+      *ArgCount = mSignatures[Mid].ArgCount;
+      if (mSignatures[Mid].Wrapper != NULL) {
+        return (UINT64)(UINTN)mSignatures[Mid].Wrapper;
+      }
+      return Pc;
+    }
+  }
+  *ArgCount = X86_EMU_MAX_ARGS;
+  return Pc;
+}
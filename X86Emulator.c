@@ -8,34 +8,66 @@
 //
 
 #include "X86Emulator.h"
+#include "ImageIndex.h"
 #include "main.h"
 
 STATIC EFI_CPU_ARCH_PROTOCOL      *mCpu;
 STATIC EFI_CPU_IO2_PROTOCOL       *mCpuIo2;
-STATIC LIST_ENTRY                 mX86ImageList;
 STATIC BOOLEAN                    gX86EmulatorIsInitialized;
 
+//
+// Registered X86 images, see ImageIndex.h. The index grows by
+// X86_IMAGE_INDEX_GROW slots at a time.
+//
+STATIC ImageIndex                 mX86ImageIndex;
+
 X86_IMAGE_RECORD*
 EFIAPI
 FindImageRecord (
   IN  EFI_PHYSICAL_ADDRESS    Address
   )
 {
-  LIST_ENTRY                  *Entry;
-  X86_IMAGE_RECORD            *Record;
-
-  for (Entry = GetFirstNode (&mX86ImageList);
-       !IsNull (&mX86ImageList, Entry);
-       Entry = GetNextNode (&mX86ImageList, Entry)) {
-
-    Record = BASE_CR (Entry, X86_IMAGE_RECORD, Link);
+  return image_index_find (&mX86ImageIndex, Address);
+}
 
-    if (Address >= Record->ImageBase &&
-        Address < Record->ImageBase + Record->ImageSize) {
-      return Record;
+STATIC
+EFI_STATUS
+InsertImageRecord (
+  IN  X86_IMAGE_RECORD        *Record
+  )
+{
+  ImageIndexEntry             *NewEntries;
+  ImageIndexEntry             *OldEntries;
+  UINTN                       NewSize;
+
+  if (image_index_full (&mX86ImageIndex)) {
+    NewSize = mX86ImageIndex.size + X86_IMAGE_INDEX_GROW;
+    NewEntries = AllocatePool (NewSize * sizeof *NewEntries);
+    if (NewEntries == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    OldEntries = image_index_move (&mX86ImageIndex, NewEntries, NewSize);
+    if (OldEntries != NULL) {
+      FreePool (OldEntries);
     }
   }
-  return NULL;
+
+  image_index_insert (&mX86ImageIndex, Record->ImageBase, Record->ImageSize,
+    Record);
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+RemoveImageRecord (
+  IN  X86_IMAGE_RECORD        *Record
+  )
+{
+  INT32                       Result;
+
+  Result = image_index_remove (&mX86ImageIndex, Record);
+  ASSERT (Result == 0);
 }
 
 BOOLEAN
@@ -46,6 +78,72 @@ pc_is_native_call (
   return FindImageRecord ((EFI_PHYSICAL_ADDRESS)Pc) == NULL;
 }
 
+VOID **
+image_tb_list (
+  IN  UINT64    Pc
+  )
+{
+  X86_IMAGE_RECORD    *Record;
+
+  Record = FindImageRecord ((EFI_PHYSICAL_ADDRESS)Pc);
+  if (Record == NULL) {
+    return NULL;
+  }
+  return &Record->TbList;
+}
+
+INT32
+image_code_immutable (
+  IN  UINT64    Start,
+  IN  UINT64    End
+  )
+{
+  X86_IMAGE_RECORD    *Record;
+
+  Record = FindImageRecord ((EFI_PHYSICAL_ADDRESS)Start);
+  if (Record == NULL || !Record->CodeImmutable) {
+    return 0;
+  }
+  return End - Record->ImageBase < Record->ImageSize;
+}
+
+//
+// An image may rewrite its own code if it has sections that are both
+// writable and executable. Otherwise, its code only changes when it is
+// unloaded, which drops all its translations.
+//
+STATIC
+BOOLEAN
+IsImageCodeImmutable (
+  IN  EFI_PHYSICAL_ADDRESS    ImageBase
+  )
+{
+  EFI_IMAGE_DOS_HEADER                  *DosHdr;
+  EFI_IMAGE_OPTIONAL_HEADER_PTR_UNION   Hdr;
+  EFI_IMAGE_SECTION_HEADER              *Section;
+  UINTN                                 Index;
+
+  DosHdr = (EFI_IMAGE_DOS_HEADER *)(UINTN)ImageBase;
+  if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE) {
+    Hdr.Pe32Plus = (EFI_IMAGE_NT_HEADERS64 *)(UINTN)(ImageBase + DosHdr->e_lfanew);
+  } else {
+    Hdr.Pe32Plus = (EFI_IMAGE_NT_HEADERS64 *)(UINTN)ImageBase;
+  }
+  if (Hdr.Pe32Plus->Signature != EFI_IMAGE_NT_SIGNATURE) {
+    return FALSE;
+  }
+
+  Section = (EFI_IMAGE_SECTION_HEADER *)((UINT8 *)&Hdr.Pe32Plus->OptionalHeader +
+                                         Hdr.Pe32Plus->FileHeader.SizeOfOptionalHeader);
+  for (Index = 0; Index < Hdr.Pe32Plus->FileHeader.NumberOfSections; Index++) {
+    if ((Section[Index].Characteristics & EFI_IMAGE_SCN_MEM_EXECUTE) &&
+        (Section[Index].Characteristics & EFI_IMAGE_SCN_MEM_WRITE)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
 STATIC
 BOOLEAN
 EFIAPI
@@ -73,10 +171,10 @@ RegisterX86Image (
   )
 {
   X86_IMAGE_RECORD    *Record;
+  EFI_STATUS          Status;
 
   DEBUG_CODE_BEGIN ();
     PE_COFF_LOADER_IMAGE_CONTEXT  ImageContext;
-    EFI_STATUS                    Status;
 
     ZeroMem (&ImageContext, sizeof (ImageContext));
 
@@ -100,8 +198,21 @@ RegisterX86Image (
 
   Record->ImageBase = ImageBase;
   Record->ImageSize = ImageSize;
+  Record->EntryPoint = (EFI_PHYSICAL_ADDRESS)(UINTN)*EntryPoint;
+  Record->TbList = NULL;
+  Record->CodeImmutable = IsImageCodeImmutable (ImageBase);
+
+  Status = InsertImageRecord (Record);
+  if (EFI_ERROR (Status)) {
+    FreePool (Record);
+    return Status;
+  }
 
-  InsertTailList (&mX86ImageList, &Record->Link);
+  //
+  // Any translation in this range was made while it was not known to
+  // contain x86 code, and exits to native code unconditionally.
+  //
+  x86emu_invalidate_range (ImageBase, ImageSize);
 
   return mCpu->SetMemoryAttributes (mCpu, ImageBase, ImageSize, EFI_MEMORY_XP);
 }
@@ -126,7 +237,14 @@ UnregisterX86Image (
   Status = mCpu->SetMemoryAttributes (mCpu, Record->ImageBase,
                    Record->ImageSize, 0);
 
-  RemoveEntryList (&Record->Link);
+  x86emu_invalidate_image (&Record->TbList);
+
+  //
+  // The firmware may still hold function pointers into this image
+  //
+  X86EmulatorReleaseTrampolines (Record->ImageBase, Record->ImageSize);
+
+  RemoveImageRecord (Record);
   FreePool (Record);
 
   return Status;
@@ -200,6 +318,33 @@ cpu_outl (
   mCpuIo2->Io.Write(mCpuIo2, EfiCpuIoWidthUint32, addr, 1, &val);
 }
 
+UINT8 *code_gen_prologue;
+
+//
+// Allocate the prologue page on the first entry into x86 code, so that
+// platforms that run none never pay for it. The regions of the code buffer
+// are allocated later, one at a time, by code_gen_buffer_grow ().
+//
+STATIC
+EFI_STATUS
+AllocateCodeGenPrologue (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  EFI_PHYSICAL_ADDRESS  Alloc;
+
+  Status = gBS->AllocatePages (AllocateAnyPages, EfiBootServicesCode, 1,
+                  &Alloc);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  code_gen_prologue = (UINT8 *)(UINTN)Alloc;
+
+  return EFI_SUCCESS;
+}
+
 UINT64
 X86EmulatorVmEntry (
   IN  UINT64              Pc,
@@ -208,19 +353,49 @@ X86EmulatorVmEntry (
   IN  UINT64              Lr
   )
 {
+  EFI_STATUS  Status;
+  INT32       ArgCount;
+
   if (!gX86EmulatorIsInitialized) {
-    x86emu_init();
+    Status = AllocateCodeGenPrologue ();
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "%a: failed to allocate code prologue - %r\n",
+        __FUNCTION__, Status));
+      ASSERT_EFI_ERROR (Status);
+      return Status;
+    }
+    x86emu_init(EFI_PAGES_TO_SIZE (CODE_GEN_BUFFER_PAGES));
+    InitializeNativeCallSignatures ();
     gX86EmulatorIsInitialized = TRUE;
   }
 
-  return run_x86_func((void*)Pc, (uint64_t *)Args);
+  //
+  // Entries through a trampoline don't know their image record. Those of
+  // unloaded images are redirected by X86EmulatorReleaseTrampolines (), so
+  // getting here without a record means the image list is corrupt.
+  //
+  if (Record == NULL) {
+    Record = FindImageRecord (Pc);
+    if (Record == NULL) {
+      DEBUG ((DEBUG_ERROR,
+        "%a: call into unregistered X86 code at 0x%lx from 0x%lx\n",
+        __FUNCTION__, Pc, Lr));
+      CpuDeadLoop ();
+      return 0;
+    }
+  }
+
+  //
+  // The only x86 prototype we know is the one of the image entry point
+  //
+  ArgCount = (Pc == Record->EntryPoint) ? 2 : X86_EMU_MAX_ARGS;
+
+  return run_x86_func((void*)Pc, (uint64_t *)Args, ArgCount);
 }
 
 extern EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL **stdout;
 extern EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL **stderr;
 
-UINT8 *code_gen_prologue;
-
 EFI_STATUS
 EFIAPI
 X86EmulatorDxeEntryPoint (
@@ -229,18 +404,6 @@ X86EmulatorDxeEntryPoint (
   )
 {
   EFI_STATUS            Status;
-  EFI_PHYSICAL_ADDRESS  Alloc;
-
-  InitializeListHead (&mX86ImageList);
-
-  Status = gBS->AllocatePages (AllocateAnyPages, EfiBootServicesCode,
-                  CODE_GEN_BUFFER_PAGES + 1, &Alloc);
-  if (EFI_ERROR (Status)) {
-    return Status;
-  }
-
-  code_gen_prologue = (UINT8 *)(UINTN)Alloc;
-  static_code_gen_buffer = code_gen_prologue + EFI_PAGE_SIZE;
 
   Status = gBS->LocateProtocol (&gEfiCpuArchProtocolGuid, NULL, (VOID **)&mCpu);
   ASSERT_EFI_ERROR(Status);
@@ -27,11 +27,30 @@
 #endif
 
 typedef struct {
-  LIST_ENTRY            Link;
   EFI_PHYSICAL_ADDRESS  ImageBase;
   UINT64                ImageSize;
+  EFI_PHYSICAL_ADDRESS  EntryPoint;
+  //
+  // Translations of this image's code, owned by the translator
+  //
+  VOID                  *TbList;
+  //
+  // The code of this image does not change while it is registered, so
+  // translated code may jump into it directly, across pages
+  //
+  BOOLEAN               CodeImmutable;
 } X86_IMAGE_RECORD;
 
+//
+// Number of arguments passed when the prototype of the callee is unknown
+//
+#define X86_EMU_MAX_ARGS        16
+
+//
+// Number of slots by which the sorted image index grows when it fills up
+//
+#define X86_IMAGE_INDEX_GROW    16
+
 VOID
 EFIAPI
 X86InterpreterSyncExceptionCallback (
@@ -45,8 +64,44 @@ FindImageRecord (
   IN  EFI_PHYSICAL_ADDRESS    Address
   );
 
+VOID
+InitializeNativeCallSignatures (
+  VOID
+  );
+
+UINT64
+X86EmulatorGetTrampoline (
+  IN  UINT64    Pc
+  );
+
+VOID
+X86EmulatorReleaseTrampolines (
+  IN  EFI_PHYSICAL_ADDRESS    ImageBase,
+  IN  UINT64                  ImageSize
+  );
+
+//
+// Ceiling on the size of the code buffer. It is split into 8 regions, which
+// are allocated one at a time as translation pressure rises. Branches out of
+// direct range (+/- 128 MB) go through veneers at the end of each region,
+// and since a region is at most 128 MB, no more than 1 GB is ever used.
+//
+#ifndef CODE_GEN_BUFFER_PAGES
 #define CODE_GEN_BUFFER_PAGES   (8 * 1024)
+#endif
+
+#if CODE_GEN_BUFFER_PAGES > (1024 * 1024 * 1024) / EFI_PAGE_SIZE
+#error "CODE_GEN_BUFFER_PAGES exceeds what the code buffer regions can use"
+#endif
+
+//
+// Each of the 8 regions must be at least 256 KB, see
+// MIN_CODE_GEN_REGION_SIZE.
+//
+#if CODE_GEN_BUFFER_PAGES < (2 * 1024 * 1024) / EFI_PAGE_SIZE
+#error "CODE_GEN_BUFFER_PAGES is below the minimum code buffer size"
+#endif
 
-extern UINT8 *static_code_gen_buffer;
+unsigned char *code_gen_region_of(unsigned long addr);
 
 void dump_x86_state(void);
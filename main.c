@@ -26,9 +26,13 @@
 #include "tcg.h"
 #include "ioport.h"
 #include "main.h"
+#ifdef X86EMU_HOST_BUILD
+#include "X86EmulatorHost.h"
+#else
 #include "X86Emulator.h"
 #include <Library/CpuLib.h>
 #include <Library/TimerLib.h>
+#endif
 
 typedef __SIZE_TYPE__ size_t;   // GCC builtin definition
 
@@ -81,6 +85,8 @@ static uint64_t gdt_table[16] = {
 #define printf_verbose(a,...) do { } while(0)
 #endif
 
+#ifndef X86EMU_HOST_BUILD
+/* the C library of the host build provides these */
 int pthread_mutex_lock(pthread_mutex_t *mutex)
 {
     return 0;
@@ -90,6 +96,7 @@ int pthread_mutex_unlock(pthread_mutex_t *mutex)
 {
     return 0;
 }
+#endif
 
 int cpu_get_pic_interrupt(CPUX86State *s)
 {
@@ -110,6 +117,7 @@ void cpu_resume_from_signal(CPUState *env, void *puc)
     __builtin_unreachable();
 }
 
+#ifndef X86EMU_HOST_BUILD
 void __assert_fail (const char *__assertion, const char *__file,
                     unsigned int __line, const char *__function)
 {
@@ -201,6 +209,7 @@ char *strdup(const char *s)
     result[len] = 0;
     return result;
 }
+#endif
 
 void disas(FILE *out, void *code, unsigned long size)
 {
@@ -285,6 +294,32 @@ void dump_x86_state(void)
     cpu_dump_state(env, stdout, fprintf, 0);
 }
 
+/* Drop all translations overlapping [start, start + size[. Blocks are
+   classified as x86 or native when they are translated, so this must be
+   called whenever an image is registered or unregistered. */
+void x86emu_invalidate_range(uint64_t start, uint64_t size)
+{
+    EFI_TPL tpl;
+    uint64_t addr;
+
+    tpl = gBS->RaiseTPL(TPL_NOTIFY);
+    for (addr = start & TARGET_PAGE_MASK; addr < start + size;
+         addr += TARGET_PAGE_SIZE) {
+        tb_invalidate_phys_page_range(addr, addr + TARGET_PAGE_SIZE, 0);
+    }
+    gBS->RestoreTPL(tpl);
+}
+
+/* Drop all translations of an image, which is about to be unloaded */
+void x86emu_invalidate_image(void **tb_list)
+{
+    EFI_TPL tpl;
+
+    tpl = gBS->RaiseTPL(TPL_NOTIFY);
+    tb_invalidate_owner(tb_list);
+    gBS->RestoreTPL(tpl);
+}
+
 bool pc_is_native_return(uint64_t pc)
 {
     printf_verbose("XXX Current IP: %llx\n", pc);
@@ -292,18 +327,112 @@ bool pc_is_native_return(uint64_t pc)
     return pc == 0x1234567890abcdefULL;
 }
 
-uint64_t run_x86_func(void *func, uint64_t *args)
+/*
+ * Call func, the native function at EIP or a wrapper for it, with the
+ * nargs first arguments of the x86 call that got us there, and return to
+ * the x86 caller. This runs from the call stub of the translated block,
+ * so the CPU loop is not left.
+ */
+void call_native_func(uint64_t func, int nargs)
+{
+    uint64_t (*f4)(uint64_t a, uint64_t b, uint64_t c, uint64_t d) = (void *)func;
+    uint64_t (*f8)(uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+                   uint64_t e, uint64_t f, uint64_t g, uint64_t h) = (void *)func;
+    uint64_t (*f)(uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+                  uint64_t e, uint64_t f, uint64_t g, uint64_t h,
+                  uint64_t i, uint64_t j, uint64_t k, uint64_t l,
+                  uint64_t m, uint64_t n, uint64_t o, uint64_t p) = (void *)func;
+    uint64_t *stackargs = (uint64_t*)env->regs[R_ESP];
+
+    /*
+     * MS x86_64 Stack Layout (in uint64_t's):
+     *
+     * ----------------
+     *   ...
+     *   arg9
+     *   arg8
+     *   arg7
+     *   arg6
+     *   arg5
+     *   arg4
+     *   home zone (reserved for called function)
+     *   home zone (reserved for called function)
+     *   home zone (reserved for called function)
+     *   home zone (reserved for called function)
+     *   return pointer
+     * ----------------
+     */
+
+    if (env->eip < 0x1000) {
+        /* Calling into the zero page, this is broken code. Shout out loud. */
+        printf("Invalid jump to zero page from caller %" PRIx64 "\n", *stackargs);
+        dump_x86_state();
+#ifdef BE_PARANOID
+        assert(env->eip >= 0x1000);
+#endif
+
+        /* Try to rescue ourselves as much as we can */
+        env->regs[R_EAX] = EFI_UNSUPPORTED;
+        env->eip = stack_pop64();
+        return;
+    }
+
+    printf_verbose("XXX  Calling aarch64 %p(%llx, %llx, %llx, %llx, %llx, %llx, %llx, %llx)\n",
+                   f, env->regs[R_ECX], env->regs[R_EDX], env->regs[8],
+                   env->regs[9], stackargs[5], stackargs[6], stackargs[7],
+                   stackargs[8]);
+    assert(!(env->eip & 0x3)); /* Make sure we're calling aarch64 code which is aligned */
+
+    /* A level entered from the native code cannot return into our block
+       unnoticed, helper_call_native() checks tb_generation() */
+    env->in_code = 0;
+
+    /*
+     * Only touch the stack slots the callee actually takes. Passing more
+     * arguments than the prototype has is harmless under AAPCS64, so we
+     * round up to what fits in x0-x3, x0-x7 or the full 16 slots.
+     */
+    if (nargs <= 4) {
+        env->regs[R_EAX] = f4(env->regs[R_ECX], env->regs[R_EDX], env->regs[8],
+                              env->regs[9]);
+    } else if (nargs <= 8) {
+        env->regs[R_EAX] = f8(env->regs[R_ECX], env->regs[R_EDX], env->regs[8],
+                              env->regs[9], stackargs[5], stackargs[6],
+                              stackargs[7], stackargs[8]);
+    } else {
+        env->regs[R_EAX] = f(env->regs[R_ECX], env->regs[R_EDX], env->regs[8], env->regs[9],
+                             stackargs[5], stackargs[6], stackargs[7], stackargs[8],
+                             stackargs[9], stackargs[10], stackargs[11], stackargs[12],
+                             stackargs[13], stackargs[14], stackargs[15], stackargs[16]);
+    }
+    env->in_code = 1;
+    printf_verbose("XXX  Finished aarch64 call to %p (return to %lx)\n", f, stackargs[0]);
+    env->eip = stack_pop64();
+}
+
+uint64_t run_x86_func(void *func, uint64_t *args, int nargs)
 {
     int trapnr;
     uint64_t r;
     int i;
-    const int maxargs = 16;
+    int nslots;
     uint8_t *stack;
     uintptr_t stack_end;
+    int pinned;
 
     /* We can not reenter if a translation is ongoing */
     assert(!in_critical);
 
+    /*
+     * An event notification function may have preempted the outer level
+     * anywhere in its translated code, or between looking up a block and
+     * entering it. We cannot tell which blocks it will run on, so keep
+     * the code buffer from being reused until we return.
+     */
+    pinned = nesting_level >= 0 && env->in_code;
+    if (pinned)
+        tb_pin_code();
+
     nesting_level++;
     assert(nesting_level < MAX_NESTING);
 
@@ -321,9 +450,15 @@ uint64_t run_x86_func(void *func, uint64_t *args)
     env->regs[8] = args[2];
     env->regs[9] = args[3];
 
-    for (i = 0; i < (maxargs - 4); i++) {
+    /*
+     * Home zone plus stack passed arguments, rounded up to an even number
+     * of slots so that RSP stays 16 byte aligned at the call
+     */
+    nslots = (MAX(nargs, 4) + 1) & ~1;
+
+    for (i = nslots - 1; i >= 4; i--) {
         /* Push arguments on stack in reverse order */
-        stack_push64(args[(maxargs - 1) - i]);
+        stack_push64(i < nargs ? args[i] : 0);
     }
 
     for (i = 0; i < 4; i++) {
@@ -339,66 +474,14 @@ uint64_t run_x86_func(void *func, uint64_t *args)
 
         asm volatile ("mov %0, sp" : "=r"(sp));
         printf_verbose("XXX Entering x86 at %lx (sp=%lx)\n", env->eip, sp);
-        env->exec_tpl = gBS->RaiseTPL (TPL_NOTIFY);
-        in_critical = 1;
+        env->in_code = 1;
         trapnr = cpu_x86_exec(env);
-        in_critical = 0;
-        gBS->RestoreTPL (env->exec_tpl);
+        env->in_code = 0;
         asm volatile ("mov %0, sp" : "=r"(sp));
         printf_verbose("XXX Left x86 at %lx (sp=%lx)\n", env->eip, sp);
         if (trapnr == EXCP_RETURN_TO_NATIVE) {
             printf_verbose("XXX Return from x86\n");
             break;
-        } else if (trapnr == EXCP_CALL_TO_NATIVE) {
-            uint64_t (*f)(uint64_t a, uint64_t b, uint64_t c, uint64_t d,
-                          uint64_t e, uint64_t f, uint64_t g, uint64_t h,
-                          uint64_t i, uint64_t j, uint64_t k, uint64_t l,
-                          uint64_t m, uint64_t n, uint64_t o, uint64_t p) = (void *)env->eip;
-            uint64_t *stackargs = (uint64_t*)env->regs[R_ESP];
-
-            /*
-             * MS x86_64 Stack Layout (in uint64_t's):
-             *
-             * ----------------
-             *   ...
-             *   arg9
-             *   arg8
-             *   arg7
-             *   arg6
-             *   arg5
-             *   arg4
-             *   home zone (reserved for called function)
-             *   home zone (reserved for called function)
-             *   home zone (reserved for called function)
-             *   home zone (reserved for called function)
-             *   return pointer
-             * ----------------
-             */
-
-            if (env->eip < 0x1000) {
-                /* Calling into the zero page, this is broken code. Shout out loud. */
-                printf("Invalid jump to zero page from caller %llx\n", *stackargs);
-                dump_x86_state();
-#ifdef BE_PARANOID
-                assert(env->eip >= 0x1000);
-#endif
-
-                /* Try to rescue ourselves as much as we can */
-                env->regs[R_EAX] = EFI_UNSUPPORTED;
-                env->eip = stack_pop64();
-            }
-
-            printf_verbose("XXX  Calling aarch64 %p(%llx, %llx, %llx, %llx, %llx, %llx, %llx, %llx)\n",
-                           f, env->regs[R_ECX], env->regs[R_EDX], env->regs[8],
-                           env->regs[9], stackargs[5], stackargs[6], stackargs[7],
-                           stackargs[8]);
-            assert(!(env->eip & 0x3)); /* Make sure we're calling aarch64 code which is aligned */
-            env->regs[R_EAX] = f(env->regs[R_ECX], env->regs[R_EDX], env->regs[8], env->regs[9],
-                                 stackargs[5], stackargs[6], stackargs[7], stackargs[8],
-                                 stackargs[9], stackargs[10], stackargs[11], stackargs[12],
-                                 stackargs[13], stackargs[14], stackargs[15], stackargs[16]);
-            printf_verbose("XXX  Finished aarch64 call to %p (return to %lx)\n", f, stackargs[0]);
-            env->eip = stack_pop64();
         } else if (trapnr == EXCP_HLT) {
             CpuSleep ();
             env->halted = 0;
@@ -409,17 +492,16 @@ uint64_t run_x86_func(void *func, uint64_t *args)
             break;
         }
     }
-
     /* Pop stack passed parameters */
     for (i = 0; i < 4; i++) {
         /* Home Zone, modifyable by function */
         stack_pop64();
     }
-    for (; i < maxargs; i++) {
+    for (; i < nslots; i++) {
         /* Double check that nobody modified the arg */
         uint64_t curarg = stack_pop64();
 
-        if (curarg != args[i]) {
+        if (i < nargs && curarg != args[i]) {
 #ifdef BE_PARANOID
             printf("Argument %d mismatch at RSP=%llx: %llx vs %llx\n",
                    i, env->regs[R_ESP], curarg, args[i]);
@@ -429,23 +511,26 @@ uint64_t run_x86_func(void *func, uint64_t *args)
     }
 
     assert(env->regs[R_ESP] == stack_end);
+    /* an event may reuse this env as soon as the level is given up */
+    r = env->regs[R_EAX];
     nesting_level--;
 
     /* Restore old context */
-    r = env->regs[R_EAX];
     cpu_single_env = env = envs[nesting_level];
+    if (pinned)
+        tb_unpin_code();
 
     return r;
 }
 
-int x86emu_init(void)
+int x86emu_init(unsigned long tb_size)
 {
     int i;
 
     x86_cpudef_setup();
     cpu_set_log_filename("qemulog");
     cpu_set_log(0);
-    cpu_exec_init_all(0);
+    cpu_exec_init_all(tb_size);
 
     /* Populate our env copies */
     for (i = 0; i < MAX_NESTING; i++) {
@@ -22,7 +22,9 @@
 
 #include <stdint.h>
 
-int x86emu_init(void);
-uint64_t run_x86_func(void *func, uint64_t *args);
+int x86emu_init(unsigned long tb_size);
+uint64_t run_x86_func(void *func, uint64_t *args, int nargs);
+void x86emu_invalidate_range(uint64_t start, uint64_t size);
+void x86emu_invalidate_image(void **tb_list);
 
 #endif
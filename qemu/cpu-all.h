@@ -576,9 +576,9 @@ int cpu_physical_log_start(target_phys_addr_t start_addr,
 
 int cpu_physical_log_stop(target_phys_addr_t start_addr,
                           ram_addr_t size);
+#endif /* !CONFIG_USER_ONLY */
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
-#endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
                         uint8_t *buf, int len, int is_write);
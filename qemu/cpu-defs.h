@@ -81,6 +81,11 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
+/* return address stack, used by the translator to predict the target
+   of a return from the call that preceded it */
+#define TB_RAS_BITS 4
+#define TB_RAS_SIZE (1 << TB_RAS_BITS)
+
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
@@ -171,6 +176,11 @@ typedef struct CPUWatchpoint {
     uint32_t interrupt_request;                                         \
     volatile sig_atomic_t exit_request;                                 \
     CPU_COMMON_TLB                                                      \
+    /* return address stack: guest return address and calling TB */     \
+    target_ulong ras_pc[TB_RAS_SIZE];                                   \
+    struct TranslationBlock *ras_tb[TB_RAS_SIZE];                       \
+    uint32_t ras_top;                                                   \
+    uint64_t ras_miss_count; /* returns that missed the prediction */   \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
     /* buffer for temporaries in the code generator */                  \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                 \
@@ -21,12 +21,44 @@
 #include "disas.h"
 #include "tcg.h"
 #include "qemu-barrier.h"
+#ifdef X86EMU_HOST_BUILD
+#include "X86EmulatorHost.h"
+#else
 #include "X86Emulator.h"
+#endif
 
 int tb_invalidated_flag;
 
+extern volatile int in_critical;
+
 //#define CONFIG_DEBUG_EXEC
 
+/*
+ * The TB hash tables, the jump lists and the code buffer are shared between
+ * all nesting levels, and an event notification function that calls back
+ * into X86 code may preempt us at any point. So raise the TPL while any of
+ * them are being updated. Executing translated code does not require this,
+ * which means chained TBs run without any TPL transitions: run_x86_func()
+ * pins the code buffer while it preempts an outer level, so the code that
+ * level runs on stays in place, see tb_pin_code().
+ *
+ * A TB found outside a critical section may have been invalidated by the
+ * time we enter one, or dropped and its slot reused if we were suspended
+ * in a native call. So note tb_generation() before the lookup, and only
+ * link or trace the TB if it is unchanged once inside the critical section.
+ */
+static inline void tb_enter_critical(CPUState *env)
+{
+    env->exec_tpl = gBS->RaiseTPL(TPL_NOTIFY);
+    in_critical = 1;
+}
+
+static inline void tb_leave_critical(CPUState *env)
+{
+    in_critical = 0;
+    gBS->RestoreTPL(env->exec_tpl);
+}
+
 bool qemu_cpu_has_work(CPUState *env)
 {
     return cpu_has_work(env);
@@ -85,55 +117,19 @@ static TranslationBlock *tb_find_slow(CPUState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1, phys_page2;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
 
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    phys_page2 = -1;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
-        }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-    if (pc == 0x1234567890abcdefULL) {
-        return NULL;
+    tb = tb_htable_lookup(env, pc, phys_pc, cs_base, flags);
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
     }
 
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
-    }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -152,7 +148,9 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        tb_enter_critical(env);
         tb = tb_find_slow(env, pc, cs_base, flags);
+        tb_leave_critical(env);
     }
     return tb;
 }
@@ -184,14 +182,14 @@ static void cpu_handle_debug_exception(CPUState *env)
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
-extern volatile int in_critical;
 
 int cpu_exec(CPUState *env)
 {
     int ret, interrupt_request;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *last_tb;
     uint8_t *tc_ptr;
     unsigned long next_tb;
+    int tb_gen;
 
     if (env->halted) {
         if (!cpu_has_work(env)) {
@@ -528,14 +526,18 @@ int cpu_exec(CPUState *env)
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
                 spin_lock(&tb_lock);
-                if (pc_is_native_return(env->eip)) {
-                    env->exception_index = EXCP_RETURN_TO_NATIVE;
-                    cpu_loop_exit(env);
-                } else if (pc_is_native_call(env->eip)) {
-                    env->exception_index = EXCP_CALL_TO_NATIVE;
-                    cpu_loop_exit(env);
-                }
+                tb_gen = tb_generation();
                 tb = tb_find_fast(env);
+                /* the block stopped itself on reaching the threshold,
+                   replace it with a trace of its hot path */
+                if (unlikely(tb->exec_count == TB_HOT_THRESHOLD)) {
+                    tb_enter_critical(env);
+                    if (tb_generation() == tb_gen) {
+                        tb = tb_gen_trace(env, tb);
+                        tb_gen = tb_generation();
+                    }
+                    tb_leave_critical(env);
+                }
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tb_invalidated_flag) {
@@ -552,9 +554,16 @@ int cpu_exec(CPUState *env)
 #endif
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                   jump, unless its code never changes. */
+                if (next_tb != 0 &&
+                    (tb->page_addr[1] == -1 || (tb->cflags & CF_IMMUTABLE))) {
+                    last_tb = (TranslationBlock *)(next_tb & ~3);
+                    if (!last_tb->jmp_next[next_tb & 3]) {
+                        tb_enter_critical(env);
+                        if (tb_generation() == tb_gen)
+                            tb_add_jump(last_tb, next_tb & 3, tb);
+                        tb_leave_critical(env);
+                    }
                 }
                 spin_unlock(&tb_lock);
 
@@ -567,11 +576,7 @@ int cpu_exec(CPUState *env)
                 if (likely(!env->exit_request)) {
                     tc_ptr = tb->tc_ptr;
                 /* execute the generated code */
-                    in_critical = 0;
-                    gBS->RestoreTPL (env->exec_tpl);
                     next_tb = tcg_qemu_tb_exec(env, tc_ptr);
-                    env->exec_tpl = gBS->RaiseTPL (TPL_NOTIFY);
-                    in_critical = 1;
                     if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
@@ -109,7 +109,22 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
 #define CODE_GEN_PHYS_HASH_BITS     15
 #define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
-#define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
+/* the code buffer and tbs[] are split into this many regions, which are
+   allocated and filled in turn. When the last one is full, the oldest
+   region is recycled rather than flushing the whole buffer. */
+#define CODE_GEN_REGIONS 8
+
+/* a region must have room for the largest TB, TCG_MAX_OP_SIZE *
+   OPC_BUF_SIZE bytes, past the point where tb_alloc() stops, plus the
+   veneer island of the host if any */
+#define MIN_CODE_GEN_REGION_SIZE     (256 * 1024)
+#define MIN_CODE_GEN_BUFFER_SIZE     (CODE_GEN_REGIONS * MIN_CODE_GEN_REGION_SIZE)
+
+/* allocate the code space of one more region of the static code buffer,
+   anywhere in memory. Returns NULL if it cannot be had. */
+void *code_gen_buffer_grow(unsigned long size);
+/* start of the code buffer region holding addr, NULL if there is none */
+uint8_t *code_gen_region_of(unsigned long addr);
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -130,13 +145,16 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_IMMUTABLE   0x10000 /* code is in an image_code_immutable() range */
+#define CF_TRACE       0x20000 /* hot trace built by tb_gen_trace() */
+#define CF_NATIVE_RETURN 0x40000 /* stub for the pc_is_native_return()
+                                    sentinel, in no page list and not in
+                                    the lookup table */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -156,9 +174,26 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
+    /* list of the TBs translated from the same x86 image, see
+       image_tb_list(). owner_pprev is NULL if the TB has no owner. */
+    struct TranslationBlock *owner_next;
+    struct TranslationBlock **owner_pprev;
     uint32_t icount;
+    /* number of times the block was entered, counted by the generated
+       code and saturating at UINT32_MAX. Unused for traces. */
+    uint32_t exec_count;
+    /* for a trace, the direction followed at each conditional branch
+       (bit n set if the n-th one was taken), so that the same code can
+       be generated again by cpu_restore_state() */
+    uint32_t trace_path;
+    uint8_t trace_len;
 };
 
+/* entries after which a block is retranslated as a trace */
+#define TB_HOT_THRESHOLD 512
+/* maximum number of conditional branches followed by a trace */
+#define TB_TRACE_MAX_BRANCHES 32
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -184,8 +219,15 @@ void tb_flush(CPUState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
-
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+void tb_invalidate_owner(void **tb_list);
+void tb_pin_code(void);
+void tb_unpin_code(void);
+TranslationBlock *tb_htable_lookup(CPUState *env1, target_ulong pc,
+                                   tb_page_addr_t phys_pc,
+                                   target_ulong cs_base, uint64_t flags);
+TranslationBlock *tb_gen_trace(CPUState *env, TranslationBlock *tb);
+int tb_trace_pick(target_ulong taken, target_ulong not_taken,
+                  target_ulong cs_base, uint64_t flags);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -269,6 +311,17 @@ TranslationBlock *tb_find_pc(unsigned long pc_ptr);
 extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
+extern int tb_flush_count;
+extern int tb_evict_count;
+extern int tb_phys_invalidate_count;
+extern int tb_gen_count;
+
+/* changes whenever a TB may have been invalidated, or its descriptor and
+   code space handed out again */
+static inline int tb_generation(void)
+{
+    return tb_flush_count + tb_evict_count + tb_phys_invalidate_count;
+}
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -56,10 +56,51 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
-static TranslationBlock *tbs;
-static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+/* TB descriptors and code space of each region, allocated when the
+   region comes into use */
+static TranslationBlock *tbs[CODE_GEN_REGIONS];
+static uint8_t *code_gen_region_buf[CODE_GEN_REGIONS];
+/* tbs[] slots and code bytes per region, number of regions in use,
+   region being filled, and number of TBs allocated in each region */
+static int code_gen_region_max_blocks;
+static unsigned long code_gen_region_size;
+static int code_gen_regions;
+static int code_gen_region;
+static int code_gen_region_tbs[CODE_GEN_REGIONS];
+static unsigned long code_gen_region_used[CODE_GEN_REGIONS];
 static int nb_tbs;
+/* number of nesting levels keeping the code buffer from being reused,
+   see tb_pin_code() */
+static int code_gen_pinned;
+
+/* TB lookup table, indexed by guest pc. Linear probing, with the lookup
+   key kept in the slot so that a probe only touches the TB it returns.
+   An empty slot has tb == NULL. The table is resized by powers of two
+   to keep its load between 1/8 and 1/2 of the number of live TBs. */
+typedef struct TBHashEntry {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    TranslationBlock *tb;
+} TBHashEntry;
+
+#define TB_HTABLE_MIN_BITS 10
+
+static TBHashEntry *tb_htable;
+static int tb_htable_bits;
+static unsigned int tb_htable_mask;
+static unsigned int tb_htable_count;
+static int tb_htable_resizes;
+static int64_t tb_htable_lookups;
+static int64_t tb_htable_probes;
+static int tb_htable_max_probe;
+
+static void tb_htable_resize(int bits);
+
+/* The return sentinel of run_x86_func() is not guest code: its stub is
+   kept aside rather than in the lookup table and in the list of a page
+   that only shares the low bits of its address. */
+static TranslationBlock *native_return_tb;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
@@ -79,7 +120,6 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
     __attribute__((aligned (32)))
 #endif
 
-static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
 /* threshold to flush the translated code buffer */
 static unsigned long code_gen_buffer_max_size;
@@ -205,8 +245,16 @@ int loglevel;
 #if !defined(CONFIG_USER_ONLY)
 static int tlb_flush_count;
 #endif
-static int tb_flush_count;
-static int tb_phys_invalidate_count;
+int tb_flush_count;
+int tb_evict_count;
+int tb_phys_invalidate_count;
+int tb_gen_count;
+static int tb_retranslate_count;
+static int tb_trace_count;
+static int tb_trace_branches;
+/* one bit per hash bucket of the PCs whose TB was dropped by a flush or
+   a region recycle, used to count retranslations */
+static uint8_t tb_evicted_map[CODE_GEN_PHYS_HASH_SIZE / 8];
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -421,17 +469,21 @@ static void tlb_unprotect_code_phys(CPUState *env, ram_addr_t ram_addr,
 #define USE_STATIC_CODE_GEN_BUFFER
 #endif
 
-#ifdef USE_STATIC_CODE_GEN_BUFFER
-uint8_t *static_code_gen_buffer;
-#endif
-
 static void code_gen_alloc(unsigned long tb_size)
 {
 #ifdef USE_STATIC_CODE_GEN_BUFFER
-    code_gen_buffer = static_code_gen_buffer;
-    code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
-    map_exec(code_gen_buffer, code_gen_buffer_size);
+    /* tb_size is only a ceiling: the glue code allocates each region on
+       its own, see code_gen_region_alloc() */
+    code_gen_buffer_size = tb_size ? tb_size : DEFAULT_CODE_GEN_BUFFER_SIZE;
+    if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE) {
+        fprintf(stderr, "Code buffer of %lu bytes is too small\n",
+                code_gen_buffer_size);
+        abort();
+    }
 #else
+    uint8_t *code_gen_buffer;
+    int i;
+
     code_gen_buffer_size = tb_size;
     if (code_gen_buffer_size == 0) {
 #if defined(CONFIG_USER_ONLY)
@@ -520,10 +572,89 @@ static void code_gen_alloc(unsigned long tb_size)
     map_exec(code_gen_buffer, code_gen_buffer_size);
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
-    code_gen_buffer_max_size = code_gen_buffer_size -
+    code_gen_region_size = (code_gen_buffer_size / CODE_GEN_REGIONS) &
+        TARGET_PAGE_MASK;
+#ifndef USE_STATIC_CODE_GEN_BUFFER
+    for (i = 0; i < CODE_GEN_REGIONS; i++)
+        code_gen_region_buf[i] = code_gen_buffer + i * code_gen_region_size;
+#endif
+#ifdef TCG_TARGET_VENEER_ISLAND_SIZE
+    /* far branches go through the island at the end of each region, so
+       the code in a region must be in branch range of it */
+    if (code_gen_region_size > TCG_TARGET_MAX_REGION_SIZE)
+        code_gen_region_size = TCG_TARGET_MAX_REGION_SIZE;
+    assert(code_gen_region_size >= MIN_CODE_GEN_REGION_SIZE &&
+           MIN_CODE_GEN_REGION_SIZE > TCG_TARGET_VENEER_ISLAND_SIZE +
+           TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    code_gen_buffer_max_size = code_gen_region_size -
+        TCG_TARGET_VENEER_ISLAND_SIZE - (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    aarch64_veneer_init(code_gen_region_size);
+#else
+    code_gen_buffer_max_size = code_gen_region_size -
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+#endif
+    code_gen_region_max_blocks = code_gen_region_size / CODE_GEN_AVG_BLOCK_SIZE;
+}
+
+/* Empty the veneer island of a region once nothing uses it anymore. */
+static inline void code_gen_region_reset(int region)
+{
+#ifdef TCG_TARGET_VENEER_ISLAND_SIZE
+    aarch64_veneer_reset(code_gen_region_buf[region]);
+#endif
+}
+
+/* Make one more region available for translation. Fails once all the
+   regions are in use, which caps the code buffer at tb_size, or when
+   memory for the region cannot be had. Regions need not be contiguous, as
+   branches between them go through veneers where the host needs them. */
+static int code_gen_region_alloc(void)
+{
+    int region = code_gen_regions;
+
+    if (region >= CODE_GEN_REGIONS)
+        return 0;
+    tbs[region] = qemu_malloc(code_gen_region_max_blocks *
+                              sizeof(TranslationBlock));
+    if (!tbs[region]) {
+        fprintf(stderr, "Could not allocate TBs for code region %d\n",
+                region);
+        return 0;
+    }
+#ifdef USE_STATIC_CODE_GEN_BUFFER
+    code_gen_region_buf[region] = code_gen_buffer_grow(code_gen_region_size);
+    if (!code_gen_region_buf[region]) {
+        qemu_free(tbs[region]);
+        tbs[region] = NULL;
+        return 0;
+    }
+#endif
+    map_exec(code_gen_region_buf[region], code_gen_region_size);
+    code_gen_region_reset(region);
+    code_gen_regions++;
+    return 1;
+}
+
+/* index of the region in use whose code space holds addr, or -1 */
+static int code_gen_region_index(unsigned long addr)
+{
+    int i;
+
+    for (i = 0; i < code_gen_regions; i++) {
+        if (addr - (unsigned long)code_gen_region_buf[i] <
+            code_gen_region_size)
+            return i;
+    }
+    return -1;
+}
+
+/* start of the region holding addr in the code buffer, or NULL if addr is
+   not generated code */
+uint8_t *code_gen_region_of(unsigned long addr)
+{
+    int region = code_gen_region_index(addr);
+
+    return region < 0 ? NULL : code_gen_region_buf[region];
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -533,7 +664,12 @@ void cpu_exec_init_all(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
+    tb_htable_resize(TB_HTABLE_MIN_BITS);
+    if (!tb_htable || !code_gen_region_alloc()) {
+        fprintf(stderr, "Could not allocate dynamic translator buffer\n");
+        abort();
+    }
+    code_gen_ptr = code_gen_region_buf[0];
     page_init();
 #if !defined(CONFIG_USER_ONLY)
     memory_map_init();
@@ -620,29 +756,329 @@ void cpu_exec_init(CPUState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+static inline TranslationBlock *tb_region_first(int region)
+{
+    return tbs[region];
+}
+
+static inline uint8_t *code_gen_region_start(int region)
+{
+    return code_gen_region_buf[region];
+}
+
+/* Allocate a new translation block in the current region. Return NULL
+   if it has too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
+    int n = code_gen_region_tbs[code_gen_region];
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (n >= code_gen_region_max_blocks ||
+        (code_gen_ptr - code_gen_region_start(code_gen_region)) >=
+        code_gen_buffer_max_size)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &tb_region_first(code_gen_region)[n];
+    code_gen_region_tbs[code_gen_region] = n + 1;
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->trace_path = 0;
+    tb->trace_len = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    int n = code_gen_region_tbs[code_gen_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (n > 0 && tb == &tb_region_first(code_gen_region)[n - 1]) {
+        code_gen_ptr = tb->tc_ptr;
+        code_gen_region_tbs[code_gen_region] = n - 1;
+        nb_tbs--;
+    }
+}
+
+static inline int tb_is_valid(TranslationBlock *tb)
+{
+    /* see tb_phys_invalidate() */
+    return tb->page_addr[0] != -1;
+}
+
+static inline void tb_link_owner(TranslationBlock *tb)
+{
+    TranslationBlock **list = (TranslationBlock **)image_tb_list(tb->pc);
+
+    tb->owner_pprev = list;
+    if (list) {
+        tb->owner_next = *list;
+        if (*list)
+            (*list)->owner_pprev = &tb->owner_next;
+        *list = tb;
+    }
+}
+
+static inline void tb_unlink_owner(TranslationBlock *tb)
+{
+    if (tb->owner_pprev) {
+        *tb->owner_pprev = tb->owner_next;
+        if (tb->owner_next)
+            tb->owner_next->owner_pprev = tb->owner_pprev;
+        tb->owner_pprev = NULL;
+    }
+}
+
+/* drop the return address predictions of all CPUs, or only those
+   returning into 'tb' if it is not NULL */
+static void tb_ras_forget(TranslationBlock *tb)
+{
+    CPUState *env;
+    int i;
+
+    for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        for (i = 0; i < TB_RAS_SIZE; i++) {
+            if (tb == NULL || env->ras_tb[i] == tb)
+                env->ras_tb[i] = NULL;
+        }
+    }
+}
+
+/* give back the code space of the invalid TBs at the end of the
+   current region */
+static void tb_reclaim_tail(void)
+{
+    TranslationBlock *tb;
+    int n = code_gen_region_tbs[code_gen_region];
+
+    /* a preempted level may still be running them */
+    if (code_gen_pinned)
+        return;
+
+    /* a TB invalidated while it ran may have pushed itself on the return
+       address stack since, and its slot is about to be reused */
+    tb_ras_forget(NULL);
+
+    while (n > 0) {
+        tb = &tb_region_first(code_gen_region)[n - 1];
+        if (tb_is_valid(tb))
+            break;
         code_gen_ptr = tb->tc_ptr;
         nb_tbs--;
+        n--;
+    }
+    code_gen_region_tbs[code_gen_region] = n;
+}
+
+static inline unsigned int tb_htable_hash(target_ulong pc)
+{
+    return (uint64_t)pc * 0x9e3779b97f4a7c15ULL >> (64 - tb_htable_bits);
+}
+
+/* rehash the live entries into a table of 1 << bits slots. The old table
+   is kept if the new one cannot be allocated. */
+static void tb_htable_resize(int bits)
+{
+    TBHashEntry *old = tb_htable, *e;
+    unsigned int i, h, old_size = old ? tb_htable_mask + 1 : 0;
+    size_t size = sizeof(TBHashEntry) << bits;
+
+    e = qemu_malloc(size);
+    if (!e)
+        return;
+    memset(e, 0, size);
+
+    tb_htable = e;
+    tb_htable_bits = bits;
+    tb_htable_mask = (1u << bits) - 1;
+    for (i = 0; i < old_size; i++) {
+        if (!old[i].tb)
+            continue;
+        h = tb_htable_hash(old[i].pc);
+        while (tb_htable[h].tb)
+            h = (h + 1) & tb_htable_mask;
+        tb_htable[h] = old[i];
+    }
+    if (old) {
+        qemu_free(old);
+        tb_htable_resizes++;
+    }
+}
+
+static void tb_htable_insert(TranslationBlock *tb)
+{
+    TBHashEntry *e;
+    unsigned int h;
+
+    if ((tb_htable_count + 1) * 2 > tb_htable_mask + 1)
+        tb_htable_resize(tb_htable_bits + 1);
+    if (tb_htable_count + 1 > tb_htable_mask) {
+        fprintf(stderr, "Internal error: TB lookup table full\n");
+        abort();
+    }
+
+    h = tb_htable_hash(tb->pc);
+    while (tb_htable[h].tb)
+        h = (h + 1) & tb_htable_mask;
+    e = &tb_htable[h];
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->tb = tb;
+    tb_htable_count++;
+}
+
+/* remove a TB, then shift back the entries that follow it in the same
+   cluster so that no tombstones are needed. The table is not shrunk
+   here, see tb_htable_shrink(). */
+static void tb_htable_remove(TranslationBlock *tb)
+{
+    unsigned int i, j, h;
+
+    i = tb_htable_hash(tb->pc);
+    while (tb_htable[i].tb != tb) {
+        /* the end of the cluster: the TB list and the table disagree */
+        if (!tb_htable[i].tb) {
+            fprintf(stderr, "Internal error: TB missing from lookup table\n");
+            abort();
+        }
+        i = (i + 1) & tb_htable_mask;
+    }
+    for (j = i;;) {
+        j = (j + 1) & tb_htable_mask;
+        if (!tb_htable[j].tb)
+            break;
+        /* the entry at j may fill the hole at i unless its home slot
+           lies cyclically in (i, j] */
+        h = tb_htable_hash(tb_htable[j].pc);
+        if (((j - h) & tb_htable_mask) >= ((j - i) & tb_htable_mask)) {
+            tb_htable[i] = tb_htable[j];
+            i = j;
+        }
+    }
+    tb_htable[i].tb = NULL;
+    tb_htable_count--;
+}
+
+/* after TBs were removed, bring the load of the table back above 1/8
+   with a single rehash */
+static void tb_htable_shrink(void)
+{
+    int bits = tb_htable_bits;
+
+    while (bits > TB_HTABLE_MIN_BITS &&
+           (uint64_t)tb_htable_count * 8 < (1u << bits))
+        bits--;
+    if (bits != tb_htable_bits)
+        tb_htable_resize(bits);
+}
+
+/* find the TB for a guest pc in the physical mappings */
+TranslationBlock *tb_htable_lookup(CPUState *env1, target_ulong pc,
+                                   tb_page_addr_t phys_pc,
+                                   target_ulong cs_base, uint64_t flags)
+{
+    TBHashEntry *e;
+    TranslationBlock *tb = NULL;
+    tb_page_addr_t phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    target_ulong virt_page2;
+    unsigned int h;
+    int probes = 0;
+
+    if (unlikely(pc_is_native_return(pc))) {
+        tb = native_return_tb;
+        if (tb && tb->cs_base == cs_base && tb->flags == flags)
+            return tb;
+        return NULL;
+    }
+
+    h = tb_htable_hash(pc);
+    for (;;) {
+        e = &tb_htable[h];
+        probes++;
+        if (!e->tb)
+            break;
+        if (e->pc == pc && e->cs_base == cs_base && e->flags == flags &&
+            e->tb->page_addr[0] == phys_page1) {
+            /* check next page if needed */
+            if (e->tb->page_addr[1] == -1) {
+                tb = e->tb;
+                break;
+            }
+            virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            if (e->tb->page_addr[1] == get_page_addr_code(env1, virt_page2)) {
+                tb = e->tb;
+                break;
+            }
+        }
+        h = (h + 1) & tb_htable_mask;
+    }
+
+    tb_htable_lookups++;
+    tb_htable_probes += probes;
+    if (probes > tb_htable_max_probe)
+        tb_htable_max_probe = probes;
+    return tb;
+}
+
+static inline void tb_mark_evicted(TranslationBlock *tb)
+{
+    unsigned int h = tb_phys_hash_func(tb->pc);
+
+    tb_evicted_map[h >> 3] |= 1 << (h & 7);
+}
+
+static inline int tb_was_evicted(target_ulong pc)
+{
+    unsigned int h = tb_phys_hash_func(pc);
+
+    return (tb_evicted_map[h >> 3] >> (h & 7)) & 1;
+}
+
+/* Move on to the next region. While below the ceiling, the code buffer
+   grows by a fresh region. After that, the next region is recycled by
+   dropping the translations it holds: as regions are filled in turn,
+   these are the oldest ones, and the rest of the code cache stays valid.
+   Jumps from other regions into the evicted TBs are reset by
+   tb_phys_invalidate(). */
+static void tb_next_region(void)
+{
+    TranslationBlock *tb;
+    int i, n;
+
+    code_gen_region_used[code_gen_region] =
+        code_gen_ptr - code_gen_region_start(code_gen_region);
+    if (code_gen_region == code_gen_regions - 1 && code_gen_region_alloc()) {
+        code_gen_region++;
+        code_gen_ptr = code_gen_region_start(code_gen_region);
+        return;
+    }
+    if (code_gen_pinned) {
+        /* a preempted level may be running code in any region */
+        fprintf(stderr, "Code buffer full while translated code is "
+                "preempted\n");
+        abort();
+    }
+    code_gen_region = (code_gen_region + 1) % code_gen_regions;
+    n = code_gen_region_tbs[code_gen_region];
+    tb = tb_region_first(code_gen_region);
+    tb_ras_forget(NULL);
+    for (i = 0; i < n; i++, tb++) {
+        if (tb_is_valid(tb)) {
+            tb_mark_evicted(tb);
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    tb_htable_shrink();
+    nb_tbs -= n;
+    code_gen_region_tbs[code_gen_region] = 0;
+    code_gen_region_used[code_gen_region] = 0;
+    code_gen_region_reset(code_gen_region);
+    code_gen_ptr = code_gen_region_start(code_gen_region);
+    if (n > 0) {
+        tb_evict_count++;
     }
 }
 
@@ -691,25 +1127,43 @@ static void page_flush_tb(void)
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i, j;
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush region=%d code_size=%ld nb_tbs=%d\n",
+           code_gen_region,
+           (unsigned long)(code_gen_ptr - code_gen_region_start(code_gen_region)),
+           nb_tbs);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if ((unsigned long)(code_gen_ptr - code_gen_region_start(code_gen_region)) >
+        code_gen_region_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
-
+    if (code_gen_pinned)
+        cpu_abort(env1, "Code buffer flushed while translated code is "
+                  "preempted\n");
+
+    for (i = 0; i < code_gen_regions; i++) {
+        for (j = 0; j < code_gen_region_tbs[i]; j++) {
+            tb_mark_evicted(&tb_region_first(i)[j]);
+            tb_unlink_owner(&tb_region_first(i)[j]);
+        }
+        code_gen_region_tbs[i] = 0;
+        code_gen_region_used[i] = 0;
+        code_gen_region_reset(i);
+    }
+    code_gen_region = 0;
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
+    tb_ras_forget(NULL);
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    memset (tb_htable, 0, (tb_htable_mask + 1) * sizeof (TBHashEntry));
+    tb_htable_count = 0;
+    native_return_tb = NULL;
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
+    code_gen_ptr = code_gen_region_start(0);
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
@@ -720,16 +1174,16 @@ void tb_flush(CPUState *env1)
 static void tb_invalidate_check(target_ulong address)
 {
     TranslationBlock *tb;
-    int i;
+    unsigned int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    for(i = 0;i <= tb_htable_mask; i++) {
+        tb = tb_htable[i].tb;
+        if (tb != NULL &&
+            !(address + TARGET_PAGE_SIZE <= tb->pc ||
+              address >= tb->pc + tb->size)) {
+            printf("ERROR invalidate: address=" TARGET_FMT_lx
+                   " PC=%08lx size=%04x\n",
+                   address, (long)tb->pc, tb->size);
         }
     }
 }
@@ -738,37 +1192,24 @@ static void tb_invalidate_check(target_ulong address)
 static void tb_page_check(void)
 {
     TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+    unsigned int i;
+    int flags1, flags2;
+
+    for(i = 0;i <= tb_htable_mask; i++) {
+        tb = tb_htable[i].tb;
+        if (tb == NULL)
+            continue;
+        flags1 = page_get_flags(tb->pc);
+        flags2 = page_get_flags(tb->pc + tb->size - 1);
+        if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+            printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+                   (long)tb->pc, tb->size, flags1, flags2);
         }
     }
 }
 
 #endif
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb,
-                             int next_offset)
-{
-    TranslationBlock *tb1;
-    for(;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -826,25 +1267,26 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *env;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
-              offsetof(TranslationBlock, phys_hash_next));
-
-    /* remove the TB from the page list */
-    if (tb->page_addr[0] != page_addr) {
-        p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
-        tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
-    }
-    if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
-        p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
-        tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+    if (tb->cflags & CF_NATIVE_RETURN) {
+        if (native_return_tb == tb)
+            native_return_tb = NULL;
+    } else {
+        /* remove the TB from the lookup table */
+        tb_htable_remove(tb);
+
+        /* remove the TB from the page list */
+        if (tb->page_addr[0] != page_addr) {
+            p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
+            tb_page_remove(&p->first_tb, tb);
+            invalidate_page_bitmap(p);
+        }
+        if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
+            p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
+            tb_page_remove(&p->first_tb, tb);
+            invalidate_page_bitmap(p);
+        }
     }
 
     tb_invalidated_flag = 1;
@@ -855,10 +1297,18 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         if (env->tb_jmp_cache[h] == tb)
             env->tb_jmp_cache[h] = NULL;
     }
+    tb_ras_forget(tb);
 
-    /* suppress this TB from the two jump lists */
-    tb_jmp_remove(tb, 0);
-    tb_jmp_remove(tb, 1);
+    tb_unlink_owner(tb);
+
+    /* suppress this TB from the two jump lists, and its own jumps: it may
+       still be running, e.g. a RAS stub, while its targets are recycled */
+    for (n1 = 0; n1 < 2; n1++) {
+        if (tb->jmp_next[n1]) {
+            tb_jmp_remove(tb, n1);
+            tb_reset_jump(tb, n1);
+        }
+    }
 
     /* suppress any remaining jumps to this TB */
     tb1 = tb->jmp_first;
@@ -874,6 +1324,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
 
+    /* no longer on any list, tb_next_region() must skip it */
+    tb->page_addr[0] = -1;
+
     tb_phys_invalidate_count++;
 }
 
@@ -945,13 +1398,18 @@ TranslationBlock *tb_gen_code(CPUState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* grow the buffer, or make room by dropping the oldest
+           translations */
+        tb_next_region();
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
+    tb_gen_count++;
+    if (tb_was_evicted(pc)) {
+        tb_retranslate_count++;
+    }
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
@@ -959,6 +1417,12 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    if (image_code_immutable(pc, pc + tb->size - 1)) {
+        tb->cflags |= CF_IMMUTABLE;
+    }
+    if (pc_is_native_return(pc)) {
+        tb->cflags |= CF_NATIVE_RETURN;
+    }
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -970,6 +1434,105 @@ TranslationBlock *tb_gen_code(CPUState *env,
     return tb;
 }
 
+/* make the blocks chained to 'tb' jump to 'new_tb' instead, and drop
+   'tb'. The patched blocks may be suspended on an outer nesting level.
+   In a native call, invalidating 'tb' changes tb_generation(), so that
+   helper_call_native() goes back to the CPU loop rather than returning
+   into them. Preempted by an event, they resume on the patched jump,
+   which leads to 'new_tb', or on the code of 'tb', which stays in place
+   as the code buffer is pinned. */
+static void tb_jmp_retarget(TranslationBlock *tb, TranslationBlock *new_tb)
+{
+    TranslationBlock *tb1, *tb2;
+    unsigned int n1;
+    int can_chain;
+
+    /* same test as in cpu_exec() */
+    can_chain = new_tb->page_addr[1] == -1 ||
+                (new_tb->cflags & CF_IMMUTABLE);
+    tb1 = tb->jmp_first;
+    for(;;) {
+        n1 = (long)tb1 & 3;
+        if (n1 == 2)
+            break;
+        tb1 = (TranslationBlock *)((long)tb1 & ~3);
+        tb2 = tb1->jmp_next[n1];
+        tb1->jmp_next[n1] = NULL;
+        if (can_chain && tb1 != tb)
+            tb_add_jump(tb1, n1, new_tb);
+        else
+            tb_reset_jump(tb1, n1);
+        tb1 = tb2;
+    }
+    tb->jmp_first = (TranslationBlock *)((long)tb | 2);
+    tb_phys_invalidate(tb, -1);
+}
+
+/* 'tb' has just been entered for the TB_HOT_THRESHOLD-th time: translate
+   it again as a trace that follows the hot side of its conditional
+   branches, and replace it with the trace. */
+TranslationBlock *tb_gen_trace(CPUState *env, TranslationBlock *tb)
+{
+    TranslationBlock *trace;
+    target_ulong pc = tb->pc, cs_base = tb->cs_base;
+    uint64_t flags = tb->flags;
+
+    /* the generated code returns at the threshold only once, make sure
+       we come here only once too even if the trace is not used */
+    tb->exec_count++;
+
+    tb_invalidated_flag = 0;
+    trace = tb_gen_code(env, pc, cs_base, flags,
+                        (tb->cflags & (CF_COUNT_MASK | CF_LAST_IO)) | CF_TRACE);
+    tb_trace_count++;
+    tb_trace_branches += trace->trace_len;
+
+    /* if making room for the trace recycled the region of 'tb', the
+       slot may now hold an unrelated block */
+    if (tb != trace && tb_is_valid(tb) && tb->pc == pc &&
+        tb->cs_base == cs_base && tb->flags == flags &&
+        !(tb->cflags & CF_TRACE)) {
+        tb_jmp_retarget(tb, trace);
+    }
+    /* the caller may not chain to 'tb' any more */
+    tb_invalidated_flag = 1;
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = trace;
+    return trace;
+}
+
+static inline uint32_t tb_trace_weight(target_ulong pc, target_ulong cs_base,
+                                       uint64_t flags)
+{
+    TranslationBlock *tb;
+
+    tb = tb_htable_lookup(cpu_single_env, pc,
+                          get_page_addr_code(cpu_single_env, pc),
+                          cs_base, flags);
+    if (!tb)
+        return 0;
+    /* a trace was entered often enough to be built */
+    if (tb->cflags & CF_TRACE)
+        return TB_HOT_THRESHOLD;
+    return tb->exec_count;
+}
+
+/* Called by the translator while building a trace: return 1 if the
+   block at 'taken' is clearly hotter than the one at 'not_taken', 0 if
+   the opposite holds and -1 if there is no clear bias. */
+int tb_trace_pick(target_ulong taken, target_ulong not_taken,
+                  target_ulong cs_base, uint64_t flags)
+{
+    uint32_t t, n;
+
+    t = tb_trace_weight(taken, cs_base, flags);
+    n = tb_trace_weight(not_taken, cs_base, flags);
+    if (t > 2 * n)
+        return 1;
+    if (n > 2 * t)
+        return 0;
+    return -1;
+}
+
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
@@ -1229,29 +1792,33 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
-
-    /* add in the page list */
-    tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
-    if (phys_page2 != -1)
-        tb_alloc_page(tb, 1, phys_page2);
-    else
+    if (tb->cflags & CF_NATIVE_RETURN) {
+        /* page_addr[0] only marks the TB as valid */
+        tb->page_addr[0] = phys_pc & TARGET_PAGE_MASK;
         tb->page_addr[1] = -1;
+        native_return_tb = tb;
+    } else {
+        /* add in the lookup table */
+        tb_htable_insert(tb);
+
+        /* add in the page list */
+        tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
+        if (phys_page2 != -1)
+            tb_alloc_page(tb, 1, phys_page2);
+        else
+            tb->page_addr[1] = -1;
+    }
 
     tb->jmp_first = (TranslationBlock *)((long)tb | 2);
     tb->jmp_next[0] = NULL;
     tb->jmp_next[1] = NULL;
 
+    /* add in the list of its image */
+    tb_link_owner(tb);
+
     /* init original jump addresses */
     if (tb->tb_next_offset[0] != 0xffff)
         tb_reset_jump(tb, 0);
@@ -1264,25 +1831,57 @@ void tb_link_page(TranslationBlock *tb,
     mmap_unlock();
 }
 
+/* invalidate all the TBs on an image list, as set up by tb_link_owner(),
+   in time proportional to their number */
+void tb_invalidate_owner(void **tb_list)
+{
+    TranslationBlock **list = (TranslationBlock **)tb_list;
+
+    while (*list != NULL) {
+        /* this unlinks the TB */
+        tb_phys_invalidate(*list, -1);
+    }
+    tb_htable_shrink();
+    tb_reclaim_tail();
+}
+
+/* Keep the code space of all TBs in place: an event has preempted a
+   nesting level which may be running any of them, or about to enter one
+   it looked up. TBs may still be invalidated, which only unchains them.
+   While pinned, the code buffer grows up to its ceiling but no region is
+   recycled and no tail reclaimed. */
+void tb_pin_code(void)
+{
+    code_gen_pinned++;
+}
+
+void tb_unpin_code(void)
+{
+    assert(code_gen_pinned > 0);
+    code_gen_pinned--;
+}
+
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(unsigned long tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, region;
     unsigned long v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *first;
 
-    if (nb_tbs <= 0)
+    /* TBs are sorted by tc_ptr within each region */
+    region = code_gen_region_index(tc_ptr);
+    if (region < 0 || code_gen_region_tbs[region] <= 0)
         return NULL;
-    if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+    if (region == code_gen_region && tc_ptr >= (unsigned long)code_gen_ptr)
         return NULL;
+    first = tb_region_first(region);
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = code_gen_region_tbs[region] - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &first[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1292,7 +1891,7 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &first[m_max];
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -4598,45 +5197,53 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
     cpu_resume_from_signal(env, NULL);
 }
 
-#if !defined(CONFIG_USER_ONLY)
-
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, r, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    unsigned long host_code_size;
+    uint64_t ras_miss_count;
     TranslationBlock *tb;
+    CPUState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    host_code_size = 0;
+    for (r = 0; r < code_gen_regions; r++) {
+        if (r == code_gen_region)
+            host_code_size += code_gen_ptr - code_gen_region_start(r);
+        else
+            host_code_size += code_gen_region_used[r];
+        for (i = 0; i < code_gen_region_tbs[r]; i++) {
+            tb = &tb_region_first(r)[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %lu/%lu\n",
+                host_code_size, code_gen_buffer_max_size * code_gen_regions);
     cpu_fprintf(f, "TB count            %d/%d\n", 
-                nb_tbs, code_gen_max_blocks);
+                nb_tbs, code_gen_region_max_blocks * code_gen_regions);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %lu bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? host_code_size / nb_tbs : 0,
+                target_code_size ? (double) host_code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4647,11 +5254,38 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d (region %d/%d, max %d)\n",
+                tb_evict_count, code_gen_region, code_gen_regions,
+                CODE_GEN_REGIONS);
+    cpu_fprintf(f, "TB translations     %d (retranslated=%d %d%%)\n",
+                tb_gen_count, tb_retranslate_count,
+                tb_gen_count ? (int)((tb_retranslate_count * 100LL) / tb_gen_count) : 0);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB traces           %d (avg branches %0.1f)\n",
+                tb_trace_count,
+                tb_trace_count ? (double)tb_trace_branches / tb_trace_count : 0);
+    cpu_fprintf(f, "TB lookup table     %u/%u entries (%d resizes)\n",
+                tb_htable_count, tb_htable_mask + 1, tb_htable_resizes);
+    cpu_fprintf(f, "TB lookups          %" PRId64 " (avg probes %0.2f, max %d)\n",
+                tb_htable_lookups,
+                tb_htable_lookups ? (double)tb_htable_probes / tb_htable_lookups : 0,
+                tb_htable_max_probe);
+    ras_miss_count = 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+        ras_miss_count += env->ras_miss_count;
+    cpu_fprintf(f, "RAS misses          %" PRIu64 "\n", ras_miss_count);
+    cpu_fprintf(f, "icache flushes      %" PRId64 " for %" PRId64
+                " code ranges (%" PRId64 " avoided)\n",
+                tcg_ctx.icache_flush_count, tcg_ctx.icache_dirty_total,
+                tcg_ctx.icache_dirty_total - tcg_ctx.icache_flush_count);
+#if !defined(CONFIG_USER_ONLY)
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
+#if !defined(CONFIG_USER_ONLY)
+
 #define MMUSUFFIX _cmmu
 #define GETPC() NULL
 #define env cpu_single_env
@@ -381,5 +381,9 @@ static inline uint64_t muldiv64(uint64_t a, uint32_t b, uint32_t c)
 
 bool pc_is_native_return(uint64_t pc);
 bool pc_is_native_call(uint64_t pc);
+void **image_tb_list(uint64_t pc);
+int image_code_immutable(uint64_t start, uint64_t end);
+uint64_t native_call_target(uint64_t pc, int *nargs);
+void call_native_func(uint64_t func, int nargs);
 
 #endif
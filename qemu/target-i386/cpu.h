@@ -767,6 +767,9 @@ typedef struct CPUX86State {
     /* Option rom emulation additions */
     int exec_tpl;
     int in_critical;
+    /* in cpu_x86_exec() and not in a native call: an event may preempt
+       the translated code of this level, see run_x86_func() */
+    int in_code;
 } CPUX86State;
 
 CPUX86State *cpu_x86_init(const char *cpu_model);
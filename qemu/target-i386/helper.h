@@ -62,6 +62,8 @@ DEF_HELPER_1(hlt, void, int)
 DEF_HELPER_1(monitor, void, tl)
 DEF_HELPER_1(mwait, void, int)
 DEF_HELPER_0(debug, void)
+DEF_HELPER_1(exit_to_native, void, int)
+DEF_HELPER_2(call_native, void, i64, int)
 DEF_HELPER_0(reset_rf, void)
 DEF_HELPER_2(raise_interrupt, void, int, int)
 DEF_HELPER_1(raise_exception, void, int)
@@ -4906,6 +4906,30 @@ void helper_debug(void)
     cpu_loop_exit(env);
 }
 
+/* leave the CPU loop so that run_x86_func() can hand control back to
+   native code (EXCP_RETURN_TO_NATIVE or EXCP_CALL_TO_NATIVE) */
+void helper_exit_to_native(int excp)
+{
+    env->exception_index = excp;
+    cpu_loop_exit(env);
+}
+
+/* call the native function for EIP from within the current block */
+void helper_call_native(uint64_t func, int nargs)
+{
+    int tb_gen = tb_generation();
+
+    call_native_func(func, nargs);
+
+    /* the native code may have re-entered the emulator, and invalidated
+       the block we would return into or reused its code space, which also
+       happens when the invalid TBs at the end of a region are reclaimed */
+    if (tb_generation() != tb_gen) {
+        env->exception_index = -1;
+        cpu_loop_exit(env);
+    }
+}
+
 void helper_reset_rf(void)
 {
     env->eflags &= ~RF_MASK;
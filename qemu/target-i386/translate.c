@@ -124,6 +124,12 @@ typedef struct DisasContext {
     int tf;     /* TF cpu flag */
     int singlestep_enabled; /* "hardware" single step enabled */
     int jmp_opt; /* use direct block chaining for direct jumps */
+    int trace; /* follow the hot side of conditional branches */
+    int trace_pos; /* number of conditional branches followed so far */
+    int trace_nb_exits; /* side exits to emit after the trace */
+    int trace_exit_label[TB_TRACE_MAX_BRANCHES];
+    target_ulong trace_exit_eip[TB_TRACE_MAX_BRANCHES];
+    int search_pc; /* replay tb->trace_path instead of recording it */
     int mem_index; /* select memory access functions */
     uint64_t flags; /* all execution flags */
     struct TranslationBlock *tb;
@@ -136,6 +142,7 @@ typedef struct DisasContext {
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
+static void gen_eob_indirect(DisasContext *s, int is_ret);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
 
@@ -289,11 +296,18 @@ static inline void gen_op_andl_A0_ffff(void)
 #define REG_LH_OFFSET 4
 #endif
 
+/* Select the high byte of a legacy register (AH, CH, DH or BH) when
+   there is no REX prefix, for byte operand 'reg'. */
+static inline int byte_reg_is_xH(int reg)
+{
+    return !(reg < 4 X86_64_DEF( || reg >= 8 || x86_64_hregs));
+}
+
 static inline void gen_op_mov_reg_v(int ot, int reg, TCGv t0)
 {
     switch(ot) {
     case OT_BYTE:
-        if (reg < 4 X86_64_DEF( || reg >= 8 || x86_64_hregs)) {
+        if (!byte_reg_is_xH(reg)) {
             tcg_gen_deposit_tl(cpu_regs[reg], cpu_regs[reg], t0, 0, 8);
         } else {
             tcg_gen_deposit_tl(cpu_regs[reg - 4], cpu_regs[reg - 4], t0, 8, 8);
@@ -350,11 +364,10 @@ static inline void gen_op_mov_v_reg(int ot, TCGv t0, int reg)
 {
     switch(ot) {
     case OT_BYTE:
-        if (reg < 4 X86_64_DEF( || reg >= 8 || x86_64_hregs)) {
+        if (!byte_reg_is_xH(reg)) {
             goto std_case;
         } else {
-            tcg_gen_shri_tl(t0, cpu_regs[reg - 4], 8);
-            tcg_gen_ext8u_tl(t0, t0);
+            tcg_gen_extract_tl(t0, cpu_regs[reg - 4], 8, 8);
         }
         break;
     default:
@@ -830,6 +843,42 @@ static void gen_compute_eflags(TCGv reg)
     tcg_gen_extu_i32_tl(reg, cpu_tmp2_i32);
 }
 
+/* compute the carry flag to 'reg' without calling the lazy flags helper,
+   when cc_op is known at translation time. Return 0 if it is not. */
+static int gen_compute_eflags_c_inline(DisasContext *s, TCGv reg)
+{
+    int size;
+
+    switch(s->cc_op) {
+    case CC_OP_ADDB ... CC_OP_ADDQ:
+        /* CF = res < src2 */
+        size = s->cc_op - CC_OP_ADDB;
+        tcg_gen_mov_tl(reg, cpu_cc_dst);
+        break;
+    case CC_OP_SUBB ... CC_OP_SUBQ:
+        /* CF = src1 < src2, with src1 = res + src2 */
+        size = s->cc_op - CC_OP_SUBB;
+        tcg_gen_add_tl(reg, cpu_cc_dst, cpu_cc_src);
+        break;
+    case CC_OP_LOGICB ... CC_OP_LOGICQ:
+        tcg_gen_movi_tl(reg, 0);
+        return 1;
+    case CC_OP_INCB ... CC_OP_DECQ:
+        tcg_gen_mov_tl(reg, cpu_cc_src);
+        return 1;
+    case CC_OP_MULB ... CC_OP_MULQ:
+        tcg_gen_setcondi_tl(TCG_COND_NE, reg, cpu_cc_src, 0);
+        return 1;
+    default:
+        return 0;
+    }
+    tcg_gen_mov_tl(cpu_tmp0, cpu_cc_src);
+    gen_extu(size, reg);
+    gen_extu(size, cpu_tmp0);
+    tcg_gen_setcond_tl(TCG_COND_LTU, reg, reg, cpu_tmp0);
+    return 1;
+}
+
 static inline void gen_setcc_slow_T0(DisasContext *s, int jcc_op)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
@@ -935,12 +984,23 @@ static int is_fast_jcc_case(DisasContext *s, int b)
     return 1;
 }
 
-/* generate a conditional jump to label 'l1' according to jump opcode
-   value 'b'. In the fast case, T0 is guaranted not to be used. */
-static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
+/* comparison that is true when the condition of jump opcode 'b' holds:
+   'reg' against 'reg2' if use_reg2 is set, against 'imm' otherwise */
+typedef struct CCPrepare {
+    TCGCond cond;
+    TCGv reg;
+    TCGv reg2;
+    target_ulong imm;
+    int use_reg2;
+} CCPrepare;
+
+/* compute the operands of the comparison for jump opcode value 'b'. In
+   the fast case, T0 is guaranted not to be used. */
+static CCPrepare gen_prepare_cc(DisasContext *s, int cc_op, int b)
 {
     int inv, jcc_op, size, cond;
     TCGv t0;
+    CCPrepare cc;
 
     inv = b & 1;
     jcc_op = (b >> 1) & 7;
@@ -975,31 +1035,32 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
                 t0 = cpu_cc_dst;
                 break;
             }
-            tcg_gen_brcondi_tl(inv ? TCG_COND_NE : TCG_COND_EQ, t0, 0, l1);
+            cc = (CCPrepare) { .cond = inv ? TCG_COND_NE : TCG_COND_EQ,
+                               .reg = t0, .imm = 0 };
             break;
         case JCC_S:
         fast_jcc_s:
             switch(size) {
             case 0:
                 tcg_gen_andi_tl(cpu_tmp0, cpu_cc_dst, 0x80);
-                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_tmp0, 
-                                   0, l1);
+                cc = (CCPrepare) { .cond = inv ? TCG_COND_EQ : TCG_COND_NE,
+                                   .reg = cpu_tmp0, .imm = 0 };
                 break;
             case 1:
                 tcg_gen_andi_tl(cpu_tmp0, cpu_cc_dst, 0x8000);
-                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_tmp0, 
-                                   0, l1);
+                cc = (CCPrepare) { .cond = inv ? TCG_COND_EQ : TCG_COND_NE,
+                                   .reg = cpu_tmp0, .imm = 0 };
                 break;
 #ifdef TARGET_X86_64
             case 2:
                 tcg_gen_andi_tl(cpu_tmp0, cpu_cc_dst, 0x80000000);
-                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_tmp0, 
-                                   0, l1);
+                cc = (CCPrepare) { .cond = inv ? TCG_COND_EQ : TCG_COND_NE,
+                                   .reg = cpu_tmp0, .imm = 0 };
                 break;
 #endif
             default:
-                tcg_gen_brcondi_tl(inv ? TCG_COND_GE : TCG_COND_LT, cpu_cc_dst, 
-                                   0, l1);
+                cc = (CCPrepare) { .cond = inv ? TCG_COND_GE : TCG_COND_LT,
+                                   .reg = cpu_cc_dst, .imm = 0 };
                 break;
             }
             break;
@@ -1033,7 +1094,8 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
                 t0 = cpu_cc_src;
                 break;
             }
-            tcg_gen_brcond_tl(cond, cpu_tmp4, t0, l1);
+            cc = (CCPrepare) { .cond = cond, .reg = cpu_tmp4, .reg2 = t0,
+                               .use_reg2 = 1 };
             break;
             
         case JCC_L:
@@ -1065,7 +1127,8 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
                 t0 = cpu_cc_src;
                 break;
             }
-            tcg_gen_brcond_tl(cond, cpu_tmp4, t0, l1);
+            cc = (CCPrepare) { .cond = cond, .reg = cpu_tmp4, .reg2 = t0,
+                               .use_reg2 = 1 };
             break;
             
         default:
@@ -1127,10 +1190,24 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
     default:
     slow_jcc:
         gen_setcc_slow_T0(s, jcc_op);
-        tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, 
-                           cpu_T[0], 0, l1);
+        cc = (CCPrepare) { .cond = inv ? TCG_COND_EQ : TCG_COND_NE,
+                           .reg = cpu_T[0], .imm = 0 };
         break;
     }
+    return cc;
+}
+
+/* generate a conditional jump to label 'l1' according to jump opcode
+   value 'b'. In the fast case, T0 is guaranted not to be used. */
+static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
+{
+    CCPrepare cc = gen_prepare_cc(s, cc_op, b);
+
+    if (cc.use_reg2) {
+        tcg_gen_brcond_tl(cc.cond, cc.reg, cc.reg2, l1);
+    } else {
+        tcg_gen_brcondi_tl(cc.cond, cc.reg, cc.imm, l1);
+    }
 }
 
 /* XXX: does not work with gdbstub "ice" single step - not a
@@ -1309,9 +1386,11 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
     }
     switch(op) {
     case OP_ADCL:
-        if (s1->cc_op != CC_OP_DYNAMIC)
-            gen_op_set_cc_op(s1->cc_op);
-        gen_compute_eflags_c(cpu_tmp4);
+        if (!gen_compute_eflags_c_inline(s1, cpu_tmp4)) {
+            if (s1->cc_op != CC_OP_DYNAMIC)
+                gen_op_set_cc_op(s1->cc_op);
+            gen_compute_eflags_c(cpu_tmp4);
+        }
         tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
         tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_tmp4);
         if (d != OR_TMP0)
@@ -1326,9 +1405,11 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         s1->cc_op = CC_OP_DYNAMIC;
         break;
     case OP_SBBL:
-        if (s1->cc_op != CC_OP_DYNAMIC)
-            gen_op_set_cc_op(s1->cc_op);
-        gen_compute_eflags_c(cpu_tmp4);
+        if (!gen_compute_eflags_c_inline(s1, cpu_tmp4)) {
+            if (s1->cc_op != CC_OP_DYNAMIC)
+                gen_op_set_cc_op(s1->cc_op);
+            gen_compute_eflags_c(cpu_tmp4);
+        }
         tcg_gen_sub_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
         tcg_gen_sub_tl(cpu_T[0], cpu_T[0], cpu_tmp4);
         if (d != OR_TMP0)
@@ -2278,6 +2359,23 @@ static inline int insn_const_size(unsigned int ot)
         return 4;
 }
 
+/* a direct jump skips the lookup of the target, so the target code must
+   stay as translated until its TB is invalidated, which unlinks the jump.
+   This holds for the pages of this TB, which are invalidated along with
+   it, and for the code of an x86 image registered as immutable. */
+static inline int use_goto_tb(DisasContext *s, target_ulong pc)
+{
+    TranslationBlock *tb = s->tb;
+
+    /* NOTE: we handle the case where the TB spans two pages here */
+    if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
+        (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))
+        return 1;
+    if (pc < tb->pc)
+        return image_code_immutable(pc, s->pc - 1);
+    return image_code_immutable(tb->pc, MAX(pc, s->pc - 1));
+}
+
 static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 {
     TranslationBlock *tb;
@@ -2285,28 +2383,79 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
-    /* NOTE: we handle the case where the TB spans two pages here */
-    if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
-        (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
-        /* jump to same page: we can use a direct jump */
+    if (use_goto_tb(s, pc))  {
+        /* we can use a direct jump */
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb((tcg_target_long)tb + tb_num);
     } else {
-        /* jump to another page: currently not optimized */
+        /* jump to code that may change: currently not optimized */
         gen_jmp_im(eip);
         gen_eob(s);
     }
 }
 
+/* choose the side of a conditional branch that a trace continues with:
+   1 for the taken side, 0 for the fall through and -1 to end the trace.
+   When the block is first translated, the choice is made from the
+   execution counts of both successors and recorded in tb->trace_path. */
+static int gen_trace_pick(DisasContext *s, target_ulong val,
+                          target_ulong next_eip)
+{
+    TranslationBlock *tb = s->tb;
+    target_ulong hot_pc;
+    int hot;
+
+    if (s->search_pc) {
+        if (s->trace_pos >= tb->trace_len)
+            return -1;
+        return (tb->trace_path >> s->trace_pos++) & 1;
+    }
+    if (s->trace_pos >= TB_TRACE_MAX_BRANCHES)
+        return -1;
+    hot = tb_trace_pick(s->cs_base + val, s->cs_base + next_eip,
+                        s->cs_base, s->flags);
+    if (hot < 0)
+        return -1;
+    /* only go forward, and stay within the size limit of a block. A
+       branch back to the start is better left to the block chaining. */
+    hot_pc = s->cs_base + (hot ? val : next_eip);
+    if (hot_pc < s->pc || hot_pc - tb->pc >= TARGET_PAGE_SIZE - 32)
+        return -1;
+    if (hot)
+        tb->trace_path |= 1u << s->trace_pos;
+    tb->trace_len = ++s->trace_pos;
+    return hot;
+}
+
+/* leave a trace at a conditional branch whose cold side is 'eip' */
+static void gen_trace_exit(DisasContext *s, target_ulong eip)
+{
+    gen_jmp_im(eip);
+#if TCG_TARGET_HAS_lookup_tb
+    tcg_gen_movi_tl(cpu_tmp0, s->cs_base + eip);
+    tcg_gen_lookup_tb(cpu_tmp0, s->cs_base, s->tb->flags);
+#else
+    tcg_gen_exit_tb(0);
+#endif
+}
+
 static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
-    int l1, l2, cc_op;
+    int l1, l2, cc_op, hot;
 
     cc_op = s->cc_op;
     gen_update_cc_op(s);
-    if (s->jmp_opt) {
+    if (s->trace && (hot = gen_trace_pick(s, val, next_eip)) >= 0) {
+        /* branch to a side exit emitted after the trace, so that the
+           hot side carries on in the same basic block */
+        l1 = gen_new_label();
+        gen_jcc1(s, cc_op, hot ? b ^ 1 : b, l1);
+        s->trace_exit_label[s->trace_nb_exits] = l1;
+        s->trace_exit_eip[s->trace_nb_exits++] = hot ? next_eip : val;
+        s->pc = s->cs_base + (hot ? val : next_eip);
+    } else if (s->jmp_opt) {
         l1 = gen_new_label();
         gen_jcc1(s, cc_op, b, l1);
         
@@ -2333,20 +2482,17 @@ static inline void gen_jcc(DisasContext *s, int b,
 
 static void gen_setcc(DisasContext *s, int b)
 {
-    int inv, jcc_op, l1;
-    TCGv t0;
+    int inv, jcc_op;
 
     if (is_fast_jcc_case(s, b)) {
-        /* nominal case: we use a jump */
-        /* XXX: make it faster by adding new instructions in TCG */
-        t0 = tcg_temp_local_new();
-        tcg_gen_movi_tl(t0, 0);
-        l1 = gen_new_label();
-        gen_jcc1(s, s->cc_op, b ^ 1, l1);
-        tcg_gen_movi_tl(t0, 1);
-        gen_set_label(l1);
-        tcg_gen_mov_tl(cpu_T[0], t0);
-        tcg_temp_free(t0);
+        /* nominal case: we use a setcond */
+        CCPrepare cc = gen_prepare_cc(s, s->cc_op, b);
+
+        if (cc.use_reg2) {
+            tcg_gen_setcond_tl(cc.cond, cpu_T[0], cc.reg, cc.reg2);
+        } else {
+            tcg_gen_setcondi_tl(cc.cond, cpu_T[0], cc.reg, cc.imm);
+        }
     } else {
         /* slow case: it is more efficient not to generate a jump,
            although it is questionnable whether this optimization is
@@ -2360,6 +2506,89 @@ static void gen_setcc(DisasContext *s, int b)
     }
 }
 
+/* div/idiv of EDX:EAX by T0 for 32 and 64 bit operands. When the
+   dividend fits in EAX (EDX is zero, or the sign extension of EAX for
+   idiv) and the divisor is neither 0 nor -1, the quotient cannot
+   overflow and a single host division is used. Otherwise the helper
+   does the full double word division and raises #DE as needed. */
+static void gen_div_EAX(DisasContext *s, int ot, int sign,
+                        target_ulong cur_eip)
+{
+    int l_slow, l_done;
+    TCGv t0, q;
+
+    l_slow = gen_new_label();
+    l_done = gen_new_label();
+    /* T0 does not survive the branches */
+    t0 = tcg_temp_local_new();
+    tcg_gen_mov_tl(t0, cpu_T[0]);
+
+    tcg_gen_mov_tl(cpu_tmp4, cpu_regs[R_EDX]);
+    if (sign) {
+        tcg_gen_mov_tl(cpu_tmp0, cpu_regs[R_EAX]);
+        gen_exts(ot, cpu_tmp0);
+        tcg_gen_sari_tl(cpu_tmp0, cpu_tmp0, (8 << ot) - 1);
+        gen_exts(ot, cpu_tmp4);
+        tcg_gen_brcond_tl(TCG_COND_NE, cpu_tmp4, cpu_tmp0, l_slow);
+    } else {
+        gen_extu(ot, cpu_tmp4);
+        tcg_gen_brcondi_tl(TCG_COND_NE, cpu_tmp4, 0, l_slow);
+    }
+    /* a single test of the divisor, as cpu_tmp4 is dead after a branch:
+       0 and -1 are the only values for which divisor + 1 <= 1 unsigned */
+    tcg_gen_mov_tl(cpu_tmp4, t0);
+    if (sign) {
+        gen_exts(ot, cpu_tmp4);
+        tcg_gen_addi_tl(cpu_tmp4, cpu_tmp4, 1);
+        tcg_gen_brcondi_tl(TCG_COND_LEU, cpu_tmp4, 1, l_slow);
+    } else {
+        gen_extu(ot, cpu_tmp4);
+        tcg_gen_brcondi_tl(TCG_COND_EQ, cpu_tmp4, 0, l_slow);
+    }
+
+    /* fast path: EAX = dividend / divisor,
+       EDX = dividend - EAX * divisor */
+    q = tcg_temp_new();
+    tcg_gen_mov_tl(cpu_tmp0, cpu_regs[R_EAX]);
+    tcg_gen_mov_tl(cpu_tmp4, t0);
+    if (sign) {
+        gen_exts(ot, cpu_tmp0);
+        gen_exts(ot, cpu_tmp4);
+        tcg_gen_div_tl(q, cpu_tmp0, cpu_tmp4);
+    } else {
+        gen_extu(ot, cpu_tmp0);
+        gen_extu(ot, cpu_tmp4);
+        tcg_gen_divu_tl(q, cpu_tmp0, cpu_tmp4);
+    }
+    tcg_gen_mul_tl(cpu_tmp4, q, cpu_tmp4);
+    tcg_gen_sub_tl(cpu_tmp0, cpu_tmp0, cpu_tmp4);
+    gen_op_mov_reg_v(ot, R_EAX, q);
+    gen_op_mov_reg_v(ot, R_EDX, cpu_tmp0);
+    tcg_temp_free(q);
+    tcg_gen_br(l_done);
+
+    gen_set_label(l_slow);
+    gen_jmp_im(cur_eip);
+#ifdef TARGET_X86_64
+    if (ot == OT_QUAD) {
+        if (sign) {
+            gen_helper_idivq_EAX(t0);
+        } else {
+            gen_helper_divq_EAX(t0);
+        }
+    } else
+#endif
+    {
+        if (sign) {
+            gen_helper_idivl_EAX(t0);
+        } else {
+            gen_helper_divl_EAX(t0);
+        }
+    }
+    gen_set_label(l_done);
+    tcg_temp_free(t0);
+}
+
 static inline void gen_op_movl_T0_seg(int seg_reg)
 {
     tcg_gen_ld32u_tl(cpu_T[0], cpu_env, 
@@ -2680,6 +2909,30 @@ static void gen_interrupt(DisasContext *s, int intno,
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* exit stub for a block whose address is not x86 code: either the
+   return sentinel pushed by run_x86_func() or a native function */
+static void gen_native_exit(DisasContext *s, int excp, target_ulong cur_eip)
+{
+    gen_jmp_im(cur_eip);
+    gen_helper_exit_to_native(tcg_const_i32(excp));
+    s->is_jmp = DISAS_TB_JUMP;
+}
+
+/* call stub for a native function: the call is made in place, and
+   execution resumes at the x86 return address it leaves in EIP */
+static void gen_native_call(DisasContext *s, target_ulong cur_eip)
+{
+    uint64_t func;
+    int nargs;
+
+    func = native_call_target(cur_eip, &nargs);
+    gen_jmp_im(cur_eip);
+    gen_helper_call_native(tcg_const_i64(func), tcg_const_i32(nargs));
+    /* this is the return of the call that got us here */
+    tcg_gen_ld_tl(cpu_T[0], cpu_env, offsetof(CPUState, eip));
+    gen_eob_indirect(s, 1);
+}
+
 static void gen_debug(DisasContext *s, target_ulong cur_eip)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
@@ -2711,6 +2964,67 @@ static void gen_eob(DisasContext *s)
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* end of block after a near indirect jump, call or return, with the new
+   eip in T0. Unless gen_eob() has work to do, the next TB is looked up
+   from the generated code instead of returning to cpu_exec(). A return
+   first tries the prediction pushed by gen_ras_push(). */
+static void gen_eob_indirect(DisasContext *s, int is_ret)
+{
+#if TCG_TARGET_HAS_lookup_tb
+    if (!(s->tb->flags & (HF_INHIBIT_IRQ_MASK | HF_RF_MASK)) &&
+        !s->singlestep_enabled && !s->tf) {
+        if (s->cc_op != CC_OP_DYNAMIC)
+            gen_op_set_cc_op(s->cc_op);
+        tcg_gen_addi_tl(cpu_tmp0, cpu_T[0], s->cs_base);
+        if (is_ret)
+            tcg_gen_lookup_ret_tb(cpu_tmp0, s->cs_base, s->tb->flags);
+        else
+            tcg_gen_lookup_tb(cpu_tmp0, s->cs_base, s->tb->flags);
+        s->is_jmp = DISAS_TB_JUMP;
+        return;
+    }
+#endif
+    gen_eob(s);
+}
+
+/* return address prediction for a near call. The call pushes its return
+   address and its TB on env->ras_pc[]/ras_tb[], and ends with a return
+   stub, emitted by gen_ras_stub(), that chains to the return address
+   through the second jump slot of the TB. A return whose address matches
+   the prediction then enters the stub directly. This needs the direct
+   jump of gen_goto_tb(), see use_goto_tb(). */
+static inline int gen_ras_enabled(DisasContext *s, target_ulong next_eip)
+{
+#if TCG_TARGET_HAS_lookup_tb && TARGET_LONG_BITS == 64
+    return s->jmp_opt && use_goto_tb(s, s->cs_base + next_eip);
+#else
+    return 0;
+#endif
+}
+
+static void gen_ras_push(DisasContext *s, target_ulong next_eip)
+{
+    tcg_gen_ld_i32(cpu_tmp2_i32, cpu_env, offsetof(CPUState, ras_top));
+    tcg_gen_addi_i32(cpu_tmp2_i32, cpu_tmp2_i32, 1);
+    tcg_gen_andi_i32(cpu_tmp2_i32, cpu_tmp2_i32, TB_RAS_SIZE - 1);
+    tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, offsetof(CPUState, ras_top));
+    /* ras_pc[] and ras_tb[] both have 8 byte entries */
+    tcg_gen_shli_i32(cpu_tmp2_i32, cpu_tmp2_i32, 3);
+    tcg_gen_ext_i32_ptr(cpu_ptr0, cpu_tmp2_i32);
+    tcg_gen_add_ptr(cpu_ptr0, cpu_ptr0, cpu_env);
+    tcg_gen_movi_tl(cpu_tmp0, s->cs_base + next_eip);
+    tcg_gen_st_tl(cpu_tmp0, cpu_ptr0, offsetof(CPUState, ras_pc));
+    tcg_gen_movi_tl(cpu_tmp0, (tcg_target_long)s->tb);
+    tcg_gen_st_tl(cpu_tmp0, cpu_ptr0, offsetof(CPUState, ras_tb));
+}
+
+static void gen_ras_stub(DisasContext *s, target_ulong next_eip)
+{
+    tcg_gen_goto_tb(1);
+    gen_jmp_im(next_eip);
+    tcg_gen_exit_tb((tcg_target_long)s->tb + 1);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -4447,7 +4761,10 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 break;
 #ifdef TARGET_X86_64
             case OT_QUAD:
-                gen_helper_mulq_EAX_T0(cpu_T[0]);
+                tcg_gen_mulu2_i64(cpu_regs[R_EAX], cpu_regs[R_EDX],
+                                  cpu_T[0], cpu_regs[R_EAX]);
+                tcg_gen_mov_tl(cpu_cc_dst, cpu_regs[R_EAX]);
+                tcg_gen_mov_tl(cpu_cc_src, cpu_regs[R_EDX]);
                 s->cc_op = CC_OP_MULQ;
                 break;
 #endif
@@ -4517,7 +4834,11 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 break;
 #ifdef TARGET_X86_64
             case OT_QUAD:
-                gen_helper_imulq_EAX_T0(cpu_T[0]);
+                tcg_gen_muls2_i64(cpu_regs[R_EAX], cpu_regs[R_EDX],
+                                  cpu_T[0], cpu_regs[R_EAX]);
+                tcg_gen_mov_tl(cpu_cc_dst, cpu_regs[R_EAX]);
+                tcg_gen_sari_tl(cpu_tmp0, cpu_regs[R_EAX], 63);
+                tcg_gen_sub_tl(cpu_cc_src, cpu_regs[R_EDX], cpu_tmp0);
                 s->cc_op = CC_OP_MULQ;
                 break;
 #endif
@@ -4535,15 +4856,11 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 break;
             default:
             case OT_LONG:
-                gen_jmp_im(pc_start - s->cs_base);
-                gen_helper_divl_EAX(cpu_T[0]);
-                break;
 #ifdef TARGET_X86_64
             case OT_QUAD:
-                gen_jmp_im(pc_start - s->cs_base);
-                gen_helper_divq_EAX(cpu_T[0]);
-                break;
 #endif
+                gen_div_EAX(s, ot, 0, pc_start - s->cs_base);
+                break;
             }
             break;
         case 7: /* idiv */
@@ -4558,15 +4875,11 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 break;
             default:
             case OT_LONG:
-                gen_jmp_im(pc_start - s->cs_base);
-                gen_helper_idivl_EAX(cpu_T[0]);
-                break;
 #ifdef TARGET_X86_64
             case OT_QUAD:
-                gen_jmp_im(pc_start - s->cs_base);
-                gen_helper_idivq_EAX(cpu_T[0]);
-                break;
 #endif
+                gen_div_EAX(s, ot, 1, pc_start - s->cs_base);
+                break;
             }
             break;
         default:
@@ -4630,7 +4943,13 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            if (gen_ras_enabled(s, next_eip)) {
+                gen_ras_push(s, next_eip);
+                gen_eob_indirect(s, 0);
+                gen_ras_stub(s, next_eip);
+            } else {
+                gen_eob_indirect(s, 0);
+            }
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4657,7 +4976,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_eob_indirect(s, 0);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4777,7 +5096,10 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
 
 #ifdef TARGET_X86_64
         if (ot == OT_QUAD) {
-            gen_helper_imulq_T0_T1(cpu_T[0], cpu_T[0], cpu_T[1]);
+            tcg_gen_muls2_i64(cpu_T[0], cpu_T[1], cpu_T[0], cpu_T[1]);
+            tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
+            tcg_gen_sari_tl(cpu_tmp0, cpu_T[0], 63);
+            tcg_gen_sub_tl(cpu_cc_src, cpu_T[1], cpu_tmp0);
         } else
 #endif
         if (ot == OT_LONG) {
@@ -5159,7 +5481,15 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             mod = (modrm >> 6) & 3;
             rm = (modrm & 7) | REX_B(s);
 
-            if (mod == 3) {
+            if (mod == 3 && ot == OT_BYTE && byte_reg_is_xH(rm)) {
+                /* movzx/movsx from AH, CH, DH or BH */
+                if (b & 8) {
+                    tcg_gen_sextract_tl(cpu_T[0], cpu_regs[rm - 4], 8, 8);
+                } else {
+                    tcg_gen_extract_tl(cpu_T[0], cpu_regs[rm - 4], 8, 8);
+                }
+                gen_op_mov_reg_T0(d_ot, reg);
+            } else if (mod == 3) {
                 gen_op_mov_TN_reg(ot, 0, rm);
                 switch(ot | (b & 8)) {
                 case OT_BYTE:
@@ -6184,7 +6514,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_eob_indirect(s, 1);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6192,7 +6522,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_eob_indirect(s, 1);
         break;
     case 0xca: /* lret im */
         val = ldsw_code(s->pc);
@@ -6262,7 +6592,13 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            if (gen_ras_enabled(s, next_eip)) {
+                gen_ras_push(s, next_eip);
+                gen_jmp(s, tval);
+                gen_ras_stub(s, next_eip);
+            } else {
+                gen_jmp(s, tval);
+            }
         }
         break;
     case 0x9a: /* lcall im */
@@ -6336,14 +6672,14 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         break;
     case 0x140 ... 0x14f: /* cmov Gv, Ev */
         {
-            int l1;
+            CCPrepare cc;
             TCGv t0;
 
             ot = dflag + OT_WORD;
             modrm = ldub_code(s->pc++);
             reg = ((modrm >> 3) & 7) | rex_r;
             mod = (modrm >> 6) & 3;
-            t0 = tcg_temp_local_new();
+            t0 = tcg_temp_new();
             if (mod != 3) {
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 gen_op_ld_v(ot + s->mem_index, t0, cpu_A0);
@@ -6351,22 +6687,19 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 rm = (modrm & 7) | REX_B(s);
                 gen_op_mov_v_reg(ot, t0, rm);
             }
-#ifdef TARGET_X86_64
-            if (ot == OT_LONG) {
-                /* XXX: specific Intel behaviour ? */
-                l1 = gen_new_label();
-                gen_jcc1(s, s->cc_op, b ^ 1, l1);
-                tcg_gen_mov_tl(cpu_regs[reg], t0);
-                gen_set_label(l1);
-                tcg_gen_ext32u_tl(cpu_regs[reg], cpu_regs[reg]);
-            } else
-#endif
-            {
-                l1 = gen_new_label();
-                gen_jcc1(s, s->cc_op, b ^ 1, l1);
-                gen_op_mov_reg_v(ot, reg, t0);
-                gen_set_label(l1);
+            /* branch free: t0 = cond ? src : dst. The destination is
+               written either way, so a 32 bit cmov always clears the
+               high half of the register (XXX: specific Intel behaviour ?) */
+            cc = gen_prepare_cc(s, s->cc_op, b);
+            if (!cc.use_reg2) {
+                cc.reg2 = tcg_const_tl(cc.imm);
+            }
+            tcg_gen_movcond_tl(cc.cond, t0, cc.reg, cc.reg2,
+                               t0, cpu_regs[reg]);
+            if (!cc.use_reg2) {
+                tcg_temp_free(cc.reg2);
             }
+            gen_op_mov_reg_v(ot, reg, t0);
             tcg_temp_free(t0);
         }
         break;
@@ -7713,6 +8046,33 @@ void optimize_flags_init(void)
 #include "helper.h"
 }
 
+/* count the entries into 'tb', and return to the main loop once it
+   reaches TB_HOT_THRESHOLD so that a trace is built, with every
+   optimization enabled. The count saturates rather than wrapping
+   around to the threshold again. */
+static void gen_exec_count(TranslationBlock *tb, target_ulong eip)
+{
+    TCGv_ptr count_ptr;
+    TCGv_i32 count, inc;
+    int l1;
+
+    count_ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    count = tcg_temp_new_i32();
+    inc = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, count_ptr, 0);
+    tcg_gen_setcondi_i32(TCG_COND_NE, inc, count, UINT32_MAX);
+    tcg_gen_add_i32(count, count, inc);
+    tcg_gen_st_i32(count, count_ptr, 0);
+    l1 = gen_new_label();
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, TB_HOT_THRESHOLD, l1);
+    tcg_temp_free_i32(inc);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(count_ptr);
+    gen_jmp_im(eip);
+    tcg_gen_exit_tb(0);
+    gen_set_label(l1);
+}
+
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
@@ -7730,6 +8090,8 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     target_ulong cs_base;
     int num_insns;
     int max_insns;
+    int native_excp;
+    int hot_count;
 
     /* generate intermediate code */
     pc_start = tb->pc;
@@ -7773,6 +8135,9 @@ static inline void gen_intermediate_code_internal(CPUState *env,
                     || (flags & HF_SOFTMMU_MASK)
 #endif
                     );
+    dc->search_pc = search_pc;
+    dc->trace_pos = 0;
+    dc->trace_nb_exits = 0;
 #if 0
     /* check addseg logic */
     if (!dc->addseg && (dc->vm86 || !dc->pe || !dc->code32))
@@ -7795,6 +8160,21 @@ static inline void gen_intermediate_code_internal(CPUState *env,
 
     gen_opc_end = gen_opc_buf + OPC_MAX_SIZE;
 
+    /* native targets are resolved once here, so that the dispatch loop
+       does not have to check every block it enters */
+    if (pc_is_native_return(pc_start))
+        native_excp = EXCP_RETURN_TO_NATIVE;
+    else if (pc_is_native_call(pc_start))
+        native_excp = EXCP_CALL_TO_NATIVE;
+    else
+        native_excp = 0;
+
+    /* blocks count their executions until they get hot, and are then
+       rebuilt by tb_gen_trace() to follow their hot path */
+    hot_count = dc->jmp_opt && !native_excp && !(flags & HF_RF_MASK) &&
+                !(tb->cflags & CF_COUNT_MASK);
+    dc->trace = hot_count && (tb->cflags & CF_TRACE);
+
     dc->is_jmp = DISAS_NEXT;
     pc_ptr = pc_start;
     lj = -1;
@@ -7804,6 +8184,11 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         max_insns = CF_COUNT_MASK;
 
     gen_icount_start();
+    if (hot_count && !dc->trace) {
+        /* most blocks never get hot, translate them quickly */
+        tcg_ctx.tier = TCG_TIER_QUICK;
+        gen_exec_count(tb, pc_start - cs_base);
+    }
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -7829,6 +8214,17 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO))
             gen_io_start();
 
+        if (unlikely(native_excp)) {
+            /* one byte long so that it never spans two pages */
+            if (native_excp == EXCP_CALL_TO_NATIVE)
+                gen_native_call(dc, pc_ptr - dc->cs_base);
+            else
+                gen_native_exit(dc, native_excp, pc_ptr - dc->cs_base);
+            pc_ptr++;
+            num_insns++;
+            break;
+        }
+
         pc_ptr = disas_insn(dc, pc_ptr);
         num_insns++;
         /* stop translation if indicated */
@@ -7861,6 +8257,11 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     }
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
+    /* the cold sides of the trace */
+    for (j = 0; j < dc->trace_nb_exits; j++) {
+        gen_set_label(dc->trace_exit_label[j]);
+        gen_trace_exit(dc, dc->trace_exit_eip[j]);
+    }
     gen_icount_end(tb, num_insns);
     *gen_opc_ptr = INDEX_op_end;
     /* we don't forget to fill the last values */
@@ -21,6 +21,9 @@ static inline uint32_t deposit32(uint32_t value, int start, int length,
     return (value & ~mask) | ((fieldval << start) & mask);
 }
 
+#define TCG_CT_CONST_LIMM32 0x100
+#define TCG_CT_CONST_LIMM64 0x200
+
 #define R_AARCH64_CONDBR19            280
 #define R_AARCH64_JUMP26              282
 #define R_AARCH64_CALL26              283
@@ -135,6 +138,18 @@ static int target_parse_constraint(TCGArgConstraint *ct,
         ct->ct |= TCG_CT_REG;
         tcg_regset_set32(ct->u.regs, 0, (1ULL << TCG_TARGET_NB_REGS) - 1);
         break;
+    case 'j': /* lookup_tb and lookup_ret_tb pc, x0 and x1 are scratch */
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, (1ULL << TCG_TARGET_NB_REGS) - 1);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X0);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X1);
+        break;
+    case 'K': /* logical immediate of a 32 bit operation */
+        ct->ct |= TCG_CT_CONST_LIMM32;
+        break;
+    case 'L': /* logical immediate of a 64 bit operation */
+        ct->ct |= TCG_CT_CONST_LIMM64;
+        break;
     case 'l': /* qemu_ld / qemu_st address, data_reg */
         ct->ct |= TCG_CT_REG;
         tcg_regset_set32(ct->u.regs, 0, (1ULL << TCG_TARGET_NB_REGS) - 1);
@@ -156,14 +171,62 @@ static int target_parse_constraint(TCGArgConstraint *ct,
     return 0;
 }
 
+/* encode 'value' as the N:immr:imms fields of a logical immediate, for a
+   64 bit (ext) or 32 bit operation. Return 0 if it cannot be encoded. */
+static int aarch64_encode_limm(uint64_t value, int ext, uint32_t *limm)
+{
+    unsigned int e, ones, pos, imms;
+    uint64_t elt, run;
+
+    if (!ext) {
+        value = (uint32_t)value;
+        value |= value << 32;
+    }
+    if (value == 0 || value == ~0ULL) {
+        return 0;
+    }
+    /* smallest element size the value is a repetition of */
+    for (e = 2; e < 64; e <<= 1) {
+        if (((value >> e) | (value << (64 - e))) == value) {
+            break;
+        }
+    }
+    elt = e == 64 ? value : value & ((1ULL << e) - 1);
+    /* the element must be a single run of ones, which may wrap around:
+       look for the run of ones, or the run of zeros if bit 0 is set */
+    run = elt & 1 ? ~elt & (e == 64 ? ~0ULL : (1ULL << e) - 1) : elt;
+    pos = ctz64(run);
+    run >>= pos;
+    if (run & (run + 1)) {
+        return 0;
+    }
+    if (elt & 1) {
+        ones = e - ctpop64(run);
+        pos = (pos + ctpop64(run)) % e;
+    } else {
+        ones = ctpop64(run);
+    }
+    /* ones rotated right by immr, element size in the top bits of imms */
+    imms = (~(2 * e - 1) & 0x3f) | (ones - 1);
+    *limm = (e == 64) << 22 | ((e - pos) % e) << 16 | imms << 10;
+    return 1;
+}
+
 static inline int tcg_target_const_match(tcg_target_long val,
                                          const TCGArgConstraint *arg_ct)
 {
     int ct = arg_ct->ct;
+    uint32_t limm;
 
     if (ct & TCG_CT_CONST) {
         return 1;
     }
+    if ((ct & TCG_CT_CONST_LIMM32) && aarch64_encode_limm(val, 0, &limm)) {
+        return 1;
+    }
+    if ((ct & TCG_CT_CONST_LIMM64) && aarch64_encode_limm(val, 1, &limm)) {
+        return 1;
+    }
 
     return 0;
 }
@@ -226,6 +289,23 @@ enum aarch64_arith_opc {
     ARITH_SUB = 0x4b,
     ARITH_ANDS = 0x6a,
     ARITH_SUBS = 0x6b,
+    /* logical operations on the inverted Rm, bit 8 is the N bit (21) */
+    ARITH_BIC = 0x10a,
+    ARITH_ORN = 0x12a,
+    ARITH_EON = 0x14a,
+};
+
+enum aarch64_limm_opc {
+    LIMM_AND = 0x12000000,
+    LIMM_OR = 0x32000000,
+    LIMM_XOR = 0x52000000,
+    LIMM_ANDS = 0x72000000,
+};
+
+enum aarch64_movw_opc {
+    MOVW_MOVN = 0x12800000,
+    MOVW_MOVZ = 0x52800000,
+    MOVW_MOVK = 0x72800000,
 };
 
 enum aarch64_srr_opc {
@@ -352,35 +432,120 @@ static inline void tcg_out_movr(TCGContext *s, int ext, TCGReg rd, TCGReg src)
     tcg_out32(s, base | src << 16 | rd);
 }
 
-static inline void tcg_out_movi_aux(TCGContext *s,
-                                    TCGReg rd, uint64_t value)
-{
-    uint32_t half, base, shift, movk = 0;
-    /* construct halfwords of the immediate with MOVZ/MOVK with LSL */
-    /* using MOVZ 0x52800000 | extended reg.. */
-    base = (value > 0xffffffff) ? 0xd2800000 : 0x52800000;
-    /* count trailing zeros in 16 bit steps, mapping 64 to 0. Emit the
-       first MOVZ with the half-word immediate skipping the zeros, with a shift
-       (LSL) equal to this number. Then morph all next instructions into MOVKs.
-       Zero the processed half-word in the value, continue until empty.
-       We build the final result 16bits at a time with up to 4 instructions,
-       but do not emit instructions for 16bit zero holes. */
-    do {
-        shift = ctz64(value) & (63 & -16);
-        half = (value >> shift) & 0xffff;
-        tcg_out32(s, base | movk | shift << 17 | half << 5 | rd);
-        movk = 0x20000000; /* morph next MOVZs into MOVKs */
-        value &= ~(0xffffUL << shift);
-    } while (value);
-}
-
-static inline void tcg_out_movi(TCGContext *s, TCGType type,
-                                TCGReg rd, tcg_target_long value)
-{
-    if (type == TCG_TYPE_I64) {
-        tcg_out_movi_aux(s, rd, value);
+static inline void tcg_out_logicali(TCGContext *s, enum aarch64_limm_opc opc,
+                                    int ext, TCGReg rd, TCGReg rn,
+                                    uint32_t limm)
+{
+    /* Using AND / ORR / EOR / ANDS Wd, Wn, #bimm, see aarch64_encode_limm */
+    tcg_out32(s, opc | ext << 31 | limm | rn << 5 | rd);
+}
+
+/* logical operation with an immediate accepted by the K or L constraint */
+static inline void tcg_out_limm(TCGContext *s, enum aarch64_limm_opc opc,
+                                int ext, TCGReg rd, TCGReg rn,
+                                tcg_target_long imm)
+{
+    uint32_t limm;
+
+    if (!aarch64_encode_limm(imm, ext, &limm)) {
+        tcg_abort();
+    }
+    tcg_out_logicali(s, opc, ext, rd, rn, limm);
+}
+
+static inline void tcg_out_movwide(TCGContext *s, enum aarch64_movw_opc opc,
+                                   int ext, TCGReg rd, uint16_t half,
+                                   unsigned int shift)
+{
+    /* Using MOVN / MOVZ / MOVK Wd, #half, LSL #shift */
+    tcg_out32(s, opc | ext << 31 | shift << 17 | half << 5 | rd);
+}
+
+static inline void tcg_out_adr(TCGContext *s, int page, TCGReg rd,
+                               tcg_target_long offset)
+{
+    /* Using ADR 0x10000000 / ADRP 0x90000000 Xd, pc + offset */
+    unsigned int base = page ? 0x90000000 : 0x10000000;
+    tcg_out32(s, base | (offset & 3) << 29 | (offset >> 2 & 0x7ffff) << 5 | rd);
+}
+
+static inline void tcg_out_addi(TCGContext *s, int ext,
+                                TCGReg rd, TCGReg rn, unsigned int aimm);
+
+static void tcg_out_movi(TCGContext *s, TCGType type,
+                         TCGReg rd, tcg_target_long value)
+{
+    uint64_t v = value, inv;
+    tcg_target_long pc = (tcg_target_long)s->code_ptr, disp;
+    unsigned int i, shift, nr_zero = 0, nr_ones = 0, nr_halves;
+    uint32_t limm;
+    int ext = 1;
+
+    /* the 32 bit forms zero the top half of the register */
+    if (type == TCG_TYPE_I32 || v <= 0xffffffff) {
+        v = (uint32_t)v;
+        ext = 0;
+    }
+    nr_halves = ext ? 4 : 2;
+    inv = ext ? ~v : ~v & 0xffffffff;
+    for (i = 0; i < nr_halves; i++) {
+        nr_zero += ((v >> (i * 16)) & 0xffff) == 0;
+        nr_ones += ((v >> (i * 16)) & 0xffff) == 0xffff;
+    }
+
+    /* single instruction forms, in order of preference */
+    if (nr_zero >= nr_halves - 1) {
+        shift = v ? ctz64(v) & (63 & -16) : 0;
+        tcg_out_movwide(s, MOVW_MOVZ, ext, rd, v >> shift, shift);
+        return;
+    }
+    if (nr_ones >= nr_halves - 1) {
+        shift = inv ? ctz64(inv) & (63 & -16) : 0;
+        tcg_out_movwide(s, MOVW_MOVN, ext, rd, inv >> shift, shift);
+        return;
+    }
+    if (aarch64_encode_limm(v, ext, &limm)) {
+        tcg_out_logicali(s, LIMM_OR, ext, rd, TCG_REG_XZR, limm);
+        return;
+    }
+    disp = v - pc;
+    if (disp >= -0x100000 && disp < 0x100000) {
+        tcg_out_adr(s, 0, rd, disp);
+        return;
+    }
+
+    /* an address near the code buffer costs ADRP + ADD, otherwise build
+       the value 16 bits at a time from MOVZ or MOVN, whichever leaves
+       fewer halfwords to fill in with MOVK */
+    disp = (tcg_target_long)(v >> 12) - (pc >> 12);
+    if (nr_halves - nr_zero > 2 && nr_halves - nr_ones > 2
+        && disp >= -0x100000 && disp < 0x100000) {
+        tcg_out_adr(s, 1, rd, disp);
+        if (v & 0xfff) {
+            tcg_out_addi(s, 1, rd, rd, v & 0xfff);
+        }
+        return;
+    }
+    if (nr_ones > nr_zero) {
+        shift = ctz64(inv) & (63 & -16);
+        tcg_out_movwide(s, MOVW_MOVN, ext, rd, inv >> shift, shift);
+        v |= 0xffffULL << shift;
+        for (i = 0; i < nr_halves; i++) {
+            shift = i * 16;
+            if (((v >> shift) & 0xffff) != 0xffff) {
+                tcg_out_movwide(s, MOVW_MOVK, ext, rd, v >> shift, shift);
+            }
+        }
     } else {
-        tcg_out_movi_aux(s, rd, value & 0xffffffff);
+        shift = ctz64(v) & (63 & -16);
+        tcg_out_movwide(s, MOVW_MOVZ, ext, rd, v >> shift, shift);
+        v &= ~(0xffffULL << shift);
+        for (i = 0; i < nr_halves; i++) {
+            shift = i * 16;
+            if ((v >> shift) & 0xffff) {
+                tcg_out_movwide(s, MOVW_MOVK, ext, rd, v >> shift, shift);
+            }
+        }
     }
 }
 
@@ -460,7 +625,9 @@ static inline void tcg_out_arith(TCGContext *s, enum aarch64_arith_opc opc,
 {
     /* Using shifted register arithmetic operations */
     /* if extended register operation (64bit) just OR with 0x80 << 24 */
-    unsigned int shift, base = ext ? (0x80 | opc) << 24 : opc << 24;
+    unsigned int shift, base = ext ? (0x80 | (opc & 0xff)) << 24
+                                   : (opc & 0xff) << 24;
+    base |= (opc >> 8) << 21;
     if (shift_imm == 0) {
         shift = 0;
     } else if (shift_imm > 0) {
@@ -471,6 +638,26 @@ static inline void tcg_out_arith(TCGContext *s, enum aarch64_arith_opc opc,
     tcg_out32(s, base | rm << 16 | shift | rn << 5 | rd);
 }
 
+static inline void tcg_out_addi(TCGContext *s, int ext,
+                                TCGReg rd, TCGReg rn, unsigned int aimm)
+{
+    /* add immediate aimm unsigned 12bit value (we use LSL 0 - no shift) */
+    /* using ADD 0x11000000 | (ext) | (aimm << 10) | (rn << 5) | rd */
+    unsigned int base = ext ? 0x91000000 : 0x11000000;
+    assert(aimm <= 0xfff);
+    tcg_out32(s, base | (aimm << 10) | (rn << 5) | rd);
+}
+
+static inline void tcg_out_subi(TCGContext *s, int ext,
+                                TCGReg rd, TCGReg rn, unsigned int aimm)
+{
+    /* sub immediate aimm unsigned 12bit value (we use LSL 0 - no shift) */
+    /* using SUB 0x51000000 | (ext) | (aimm << 10) | (rn << 5) | rd */
+    unsigned int base = ext ? 0xd1000000 : 0x51000000;
+    assert(aimm <= 0xfff);
+    tcg_out32(s, base | (aimm << 10) | (rn << 5) | rd);
+}
+
 static inline void tcg_out_mul(TCGContext *s, int ext,
                                TCGReg rd, TCGReg rn, TCGReg rm)
 {
@@ -479,6 +666,82 @@ static inline void tcg_out_mul(TCGContext *s, int ext,
     tcg_out32(s, base | rm << 16 | rn << 5 | rd);
 }
 
+static inline void tcg_out_div(TCGContext *s, int sign, int ext,
+                               TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* Using SDIV 0x1ac00c00 / UDIV 0x1ac00800 Wd, Wn, Wm */
+    unsigned int base;
+
+    if (sign) {
+        base = ext ? 0x9ac00c00 : 0x1ac00c00;
+    } else {
+        base = ext ? 0x9ac00800 : 0x1ac00800;
+    }
+    tcg_out32(s, base | rm << 16 | rn << 5 | rd);
+}
+
+static inline void tcg_out_rem(TCGContext *s, int sign, int ext,
+                               TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* Using SDIV / UDIV TMP, Wn, Wm then MSUB 0x1b008000 Wd, TMP, Wm, Wn */
+    unsigned int base = ext ? 0x9b008000 : 0x1b008000;
+
+    tcg_out_div(s, sign, ext, TCG_REG_TMP, rn, rm);
+    tcg_out32(s, base | rm << 16 | rn << 10 | TCG_REG_TMP << 5 | rd);
+}
+
+static inline void tcg_out_mulh(TCGContext *s, int sign,
+                                TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* Using UMULH 0x9bc07c00 / SMULH 0x9b407c00 Xd, Xn, Xm */
+    unsigned int base = sign ? 0x9b407c00 : 0x9bc07c00;
+    tcg_out32(s, base | rm << 16 | rn << 5 | rd);
+}
+
+static inline void tcg_out_adcsbc(TCGContext *s, int sub, int ext,
+                                  TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* Using ADC 0x1a000000 / SBC 0x5a000000 Wd, Wn, Wm */
+    unsigned int base;
+
+    if (sub) {
+        base = ext ? 0xda000000 : 0x5a000000;
+    } else {
+        base = ext ? 0x9a000000 : 0x1a000000;
+    }
+    tcg_out32(s, base | rm << 16 | rn << 5 | rd);
+}
+
+/* double word add2 / sub2: ADDS / SUBS on the low halves, ADC / SBC on
+   the high halves. The low half of the result may be allocated to a
+   register holding one of the high inputs, go through TMP if so. */
+static void tcg_out_addsub2(TCGContext *s, int sub, int ext,
+                            TCGReg rl, TCGReg rh, TCGReg al, TCGReg ah,
+                            TCGReg bl, TCGReg bh)
+{
+    TCGReg t = (rl == ah || rl == bh) ? TCG_REG_TMP : rl;
+
+    tcg_out_arith(s, sub ? ARITH_SUBS : ARITH_ADDS, ext, t, al, bl, 0);
+    tcg_out_adcsbc(s, sub, ext, rh, ah, bh);
+    if (t != rl) {
+        tcg_out_movr(s, ext, rl, t);
+    }
+}
+
+/* full 64x64 -> 128 bit multiply: MUL for the low half, UMULH / SMULH
+   for the high half, with the same care for overlapping registers. */
+static void tcg_out_mul2(TCGContext *s, int sign, TCGReg rl, TCGReg rh,
+                         TCGReg a, TCGReg b)
+{
+    TCGReg t = (rl == a || rl == b) ? TCG_REG_TMP : rl;
+
+    tcg_out_mul(s, 1, t, a, b);
+    tcg_out_mulh(s, sign, rh, a, b);
+    if (t != rl) {
+        tcg_out_movr(s, 1, rl, t);
+    }
+}
+
 static inline void tcg_out_shiftrot_reg(TCGContext *s,
                                         enum aarch64_srr_opc opc, int ext,
                                         TCGReg rd, TCGReg rn, TCGReg rm)
@@ -504,6 +767,14 @@ static inline void tcg_out_sbfm(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
     tcg_out32(s, base | a << 16 | b << 10 | rn << 5 | rd);
 }
 
+static inline void tcg_out_bfm(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                               unsigned int a, unsigned int b)
+{
+    /* Using BFM 0x33000000 Wd, Wn, a, b */
+    unsigned int base = ext ? 0xb3400000 : 0x33000000;
+    tcg_out32(s, base | a << 16 | b << 10 | rn << 5 | rd);
+}
+
 static inline void tcg_out_extr(TCGContext *s, int ext, TCGReg rd,
                                 TCGReg rn, TCGReg rm, unsigned int a)
 {
@@ -565,6 +836,103 @@ static inline void tcg_out_cset(TCGContext *s, int ext, TCGReg rd, TCGCond c)
     tcg_out32(s, base | tcg_cond_to_aarch64[tcg_invert_cond(c)] << 12 | rd);
 }
 
+static inline void tcg_out_csel(TCGContext *s, int ext, TCGReg rd,
+                                TCGReg rn, TCGReg rm, TCGCond c)
+{
+    /* Using CSEL 0x1a800000 Xd, Xn, Xm, cond */
+    unsigned int base = ext ? 0x9a800000 : 0x1a800000;
+    tcg_out32(s, base | rm << 16 | tcg_cond_to_aarch64[c] << 12
+              | rn << 5 | rd);
+}
+
+/* Branches that cannot reach their target with the 26 bit offset of B
+   and BL go through a veneer, which loads the target into TMP:
+
+       ldr     x8, 1f
+       br      x8
+   1:  .quad   target
+
+   Each region of the code buffer ends with an island of these, in range
+   of all code in the region. Veneers are shared by target and are not
+   changed once written, so that linking a TB to a far one is still a
+   single store to its B instruction. An island is only emptied along
+   with its region, when no code using it is left. Regions are allocated
+   separately, so the island of a branch is found from the region that
+   holds it. */
+
+#define VENEER_SIZE             16
+#define VENEER_CACHE_BITS       6
+
+static unsigned long veneer_region_size;
+static uint8_t *veneer_cache[1 << VENEER_CACHE_BITS];
+
+void aarch64_veneer_init(unsigned long region_size)
+{
+    veneer_region_size = region_size;
+}
+
+void aarch64_veneer_reset(uint8_t *region)
+{
+    memset(region + veneer_region_size - TCG_TARGET_VENEER_ISLAND_SIZE, 0,
+           TCG_TARGET_VENEER_ISLAND_SIZE);
+}
+
+static inline int aarch64_in_b_range(tcg_target_long from,
+                                     tcg_target_long target)
+{
+    tcg_target_long offset = (target - from) / 4;
+    return offset >= -0x02000000 && offset < 0x02000000;
+}
+
+/* return a veneer for target that a branch at from can reach, or 0 if
+   there is none and no room is left for one. Unused slots of an island
+   are zero, and a lookup always returns the first slot for its target,
+   so that retranslation emits the same code. */
+static tcg_target_long aarch64_veneer(tcg_target_long from,
+                                      tcg_target_long target)
+{
+    uint8_t *region, *island, *end, *v;
+    unsigned int h;
+
+    region = veneer_region_size ? code_gen_region_of(from) : NULL;
+    if (!region) {
+        return 0;
+    }
+    island = region + veneer_region_size - TCG_TARGET_VENEER_ISLAND_SIZE;
+    end = island + TCG_TARGET_VENEER_ISLAND_SIZE;
+    if (!aarch64_in_b_range(from, (tcg_target_long)island)) {
+        return 0;
+    }
+
+    h = ((uint64_t)target >> 2) & ((1 << VENEER_CACHE_BITS) - 1);
+    v = veneer_cache[h];
+    if (v >= island && v < end
+        && *(uint64_t *)(v + 8) == (uint64_t)target) {
+        return (tcg_target_long)v;
+    }
+
+    for (v = island; v < end; v += VENEER_SIZE) {
+        uint64_t lit = *(uint64_t *)(v + 8);
+        if (lit == (uint64_t)target) {
+            break;
+        }
+        if (lit == 0) {
+            /* LDR x8, #8; BR x8 */
+            *(uint32_t *)v = 0x58000040 | TCG_REG_TMP;
+            *(uint32_t *)(v + 4) = 0xd61f0000 | TCG_REG_TMP << 5;
+            *(uint64_t *)(v + 8) = target;
+            tcg_icache_dirty(&tcg_ctx, (tcg_target_long)v,
+                             (tcg_target_long)v + VENEER_SIZE);
+            break;
+        }
+    }
+    if (v == end) {
+        return 0;
+    }
+    veneer_cache[h] = v;
+    return (tcg_target_long)v;
+}
+
 static inline void tcg_out_goto(TCGContext *s, tcg_target_long target)
 {
     tcg_target_long offset;
@@ -614,6 +982,15 @@ static inline void tcg_out_goto_cond(TCGContext *s, TCGCond c,
     tcg_out32(s, 0x54000000 | tcg_cond_to_aarch64[c] | offset << 5);
 }
 
+static inline void tcg_out_cbz_noaddr(TCGContext *s, int ext, int nz,
+                                      TCGReg rt)
+{
+    /* Using CBZ 0x34000000 Wt, or CBNZ 0x35000000 Wt, offset patched
+       later with reloc_pc19 */
+    unsigned int base = ext ? 0xb4000000 : 0x34000000;
+    tcg_out32(s, base | (nz ? 0x01000000 : 0) | rt);
+}
+
 static inline void tcg_out_callr(TCGContext *s, TCGReg reg)
 {
     tcg_out32(s, 0xd63f0000 | reg << 5);
@@ -626,50 +1003,64 @@ static inline void tcg_out_gotor(TCGContext *s, TCGReg reg)
 
 static inline void tcg_out_call(TCGContext *s, tcg_target_long target)
 {
-    tcg_target_long offset;
-
-    offset = (target - (tcg_target_long)s->code_ptr) / 4;
+    tcg_target_long from = (tcg_target_long)s->code_ptr;
+    tcg_target_long veneer;
 
-    if (offset < -0x02000000 || offset >= 0x02000000) { /* out of 26bit rng */
-        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
-        tcg_out_callr(s, TCG_REG_TMP);
-    } else {
-        tcg_out32(s, 0x94000000 | (offset & 0x03ffffff));
+    if (!aarch64_in_b_range(from, target)) { /* out of 26bit rng */
+        veneer = aarch64_veneer(from, target);
+        if (!veneer) {
+            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+            tcg_out_callr(s, TCG_REG_TMP);
+            return;
+        }
+        target = veneer;
     }
+    tcg_out32(s, 0x94000000 | (((target - from) / 4) & 0x03ffffff));
 }
 
-/* encode a logical immediate, mapping user parameter
-   M=set bits pattern length to S=M-1 */
-static inline unsigned int
-aarch64_limm(unsigned int m, unsigned int r)
+/* like tcg_out_goto, for targets outside of the TB, which may be out of
+   range */
+static inline void tcg_out_goto_far(TCGContext *s, tcg_target_long target)
 {
-    assert(m > 0);
-    return r << 16 | (m - 1) << 10;
+    tcg_target_long from = (tcg_target_long)s->code_ptr;
+    tcg_target_long veneer;
+
+    if (!aarch64_in_b_range(from, target)) {
+        veneer = aarch64_veneer(from, target);
+        if (!veneer) {
+            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+            tcg_out_gotor(s, TCG_REG_TMP);
+            return;
+        }
+        target = veneer;
+    }
+    tcg_out_goto(s, target);
 }
 
-/* test a register against an immediate bit pattern made of
-   M set bits rotated right by R.
-   Examples:
-   to test a 32/64 reg against 0x00000007, pass M = 3,  R = 0.
-   to test a 32/64 reg against 0x000000ff, pass M = 8,  R = 0.
-   to test a 32bit reg against 0xff000000, pass M = 8,  R = 8.
-   to test a 32bit reg against 0xff0000ff, pass M = 16, R = 8.
- */
+/* test a register against an immediate bit pattern, which must be
+   encodable as a logical immediate (see aarch64_encode_limm) */
 static inline void tcg_out_tst(TCGContext *s, int ext, TCGReg rn,
-                               unsigned int m, unsigned int r)
+                               uint64_t imm)
 {
+    uint32_t limm;
+
+    if (!aarch64_encode_limm(imm, ext, &limm)) {
+        tcg_abort();
+    }
     /* using TST alias of ANDS XZR, Xn,#bimm64 0x7200001f */
-    unsigned int base = ext ? 0xf240001f : 0x7200001f;
-    tcg_out32(s, base | aarch64_limm(m, r) | rn << 5);
+    tcg_out_logicali(s, LIMM_ANDS, ext, TCG_REG_XZR, rn, limm);
 }
 
 /* and a register with a bit pattern, similarly to TST, no flags change */
 static inline void tcg_out_andi(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
-                                unsigned int m, unsigned int r)
+                                uint64_t imm)
 {
-    /* using AND 0x12000000 */
-    unsigned int base = ext ? 0x92400000 : 0x12000000;
-    tcg_out32(s, base | aarch64_limm(m, r) | rn << 5 | rd);
+    uint32_t limm;
+
+    if (!aarch64_encode_limm(imm, ext, &limm)) {
+        tcg_abort();
+    }
+    tcg_out_logicali(s, LIMM_AND, ext, rd, rn, limm);
 }
 
 static inline void tcg_out_ret(TCGContext *s)
@@ -680,17 +1071,28 @@ static inline void tcg_out_ret(TCGContext *s)
 
 void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr)
 {
-    tcg_target_long target, offset;
+    tcg_target_long target;
     target = (tcg_target_long)addr;
-    offset = (target - (tcg_target_long)jmp_addr) / 4;
 
-    if (offset < -0x02000000 || offset >= 0x02000000) {
-        /* out of 26bit range */
-        tcg_abort();
+    if (!aarch64_in_b_range(jmp_addr, target)) {
+        /* out of 26bit range. Without a veneer, leave the jump pointing
+           to the next instruction, which exits the TB as if unlinked */
+        target = aarch64_veneer(jmp_addr, target);
+        if (!target) {
+            target = jmp_addr + 4;
+        }
     }
 
     patch_reloc((uint8_t *)jmp_addr, R_AARCH64_JUMP26, target, 0);
-    flush_icache_range(jmp_addr, jmp_addr + 4);
+
+    /* a link is only taken once generated code is entered again, but
+       unlinking may have to stop code that is running right now, as
+       cpu_unlink_tb() does */
+    if (target == jmp_addr + 4) {
+        flush_icache_range(jmp_addr, jmp_addr + 4);
+    } else {
+        tcg_icache_dirty(&tcg_ctx, jmp_addr, jmp_addr + 4);
+    }
 }
 
 static inline void tcg_out_goto_label(TCGContext *s, int label_index)
@@ -880,9 +1282,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
     tcg_out_movr(s, 1, TCG_REG_X0, TCG_AREG0);
     tcg_out_movr(s, (TARGET_LONG_BITS == 64), TCG_REG_X1, addr_reg);
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X2, mem_index);
-    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP,
-                 (tcg_target_long)qemu_ld_helpers[s_bits]);
-    tcg_out_callr(s, TCG_REG_TMP);
+    tcg_out_call(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
 
     if (opc & 0x04) { /* sign extend */
         tcg_out_sxt(s, 1, s_bits, data_reg, TCG_REG_X0);
@@ -916,9 +1316,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
     tcg_out_movr(s, (TARGET_LONG_BITS == 64), TCG_REG_X1, addr_reg);
     tcg_out_movr(s, 1, TCG_REG_X2, data_reg);
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X3, mem_index);
-    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP,
-                 (tcg_target_long)qemu_st_helpers[s_bits]);
-    tcg_out_callr(s, TCG_REG_TMP);
+    tcg_out_call(s, (tcg_target_long)qemu_st_helpers[s_bits]);
 
 #else /* !CONFIG_SOFTMMU */
     tcg_out_qemu_st_direct(s, opc, data_reg, addr_reg,
@@ -928,6 +1326,139 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 
 static uint8_t *tb_ret_addr;
 
+/* probe env->tb_jmp_cache for the TB at guest address pc, and jump to it
+   if its cs_base and flags are the given ones and no interrupt is
+   pending. Otherwise return to cpu_exec() as exit_tb(0) does. */
+static void tcg_out_lookup_tb(TCGContext *s, TCGReg pc,
+                              tcg_target_long cs_base, uint64_t flags)
+{
+    int ext = TARGET_LONG_BITS == 64;
+    int shift = TARGET_PAGE_BITS - TB_JMP_PAGE_BITS;
+    uint8_t *miss[5];
+    int i, n = 0;
+
+    /* x1 = tb_jmp_cache_hash_func(pc) */
+    tcg_out_arith(s, ARITH_XOR, ext, TCG_REG_X0, pc, pc, shift);
+    tcg_out_ubfm(s, 1, TCG_REG_X1, TCG_REG_X0,
+                 shift, shift + TB_JMP_CACHE_BITS - 1);
+    tcg_out_bfm(s, 1, TCG_REG_X1, TCG_REG_X0, 0, TB_JMP_PAGE_BITS - 1);
+
+    /* x1 = env->tb_jmp_cache[x1] */
+    tcg_out_arith(s, ARITH_ADD, 1, TCG_REG_X1, TCG_AREG0, TCG_REG_X1, -3);
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X1, TCG_REG_X1,
+               offsetof(CPUState, tb_jmp_cache));
+    miss[n++] = s->code_ptr;
+    tcg_out_cbz_noaddr(s, 1, 0, TCG_REG_X1);
+
+    /* same checks as tb_find_fast() */
+    tcg_out_ld(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, pc));
+    tcg_out_cmp(s, ext, TCG_REG_X0, pc, 0);
+    miss[n++] = s->code_ptr;
+    tcg_out32(s, 0x54000000 | COND_NE);
+
+    tcg_out_ld(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, cs_base));
+    if (cs_base) {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, cs_base);
+        tcg_out_cmp(s, ext, TCG_REG_X0, TCG_REG_TMP, 0);
+    } else {
+        tcg_out_cmp(s, ext, TCG_REG_X0, TCG_REG_XZR, 0);
+    }
+    miss[n++] = s->code_ptr;
+    tcg_out32(s, 0x54000000 | COND_NE);
+
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, flags));
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, flags);
+    tcg_out_cmp(s, 1, TCG_REG_X0, TCG_REG_TMP, 0);
+    miss[n++] = s->code_ptr;
+    tcg_out32(s, 0x54000000 | COND_NE);
+
+    tcg_out_ld(s, TCG_TYPE_I32, TCG_REG_X0, TCG_AREG0,
+               offsetof(CPUState, interrupt_request));
+    miss[n++] = s->code_ptr;
+    tcg_out_cbz_noaddr(s, 0, 1, TCG_REG_X0);
+
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, tc_ptr));
+    tcg_out_gotor(s, TCG_REG_X0);
+
+    for (i = 0; i < n; i++) {
+        reloc_pc19(miss[i], (tcg_target_long)s->code_ptr);
+    }
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, 0);
+    tcg_out_goto_far(s, (tcg_target_long)tb_ret_addr);
+}
+
+/* pop the return address stack. If the prediction is pc, and the calling
+   TB was translated for the given cs_base and flags, enter its return
+   stub, which chains to the code after the call. Otherwise, continue as
+   tcg_out_lookup_tb(). */
+static void tcg_out_lookup_ret_tb(TCGContext *s, TCGReg pc,
+                                  tcg_target_long cs_base, uint64_t flags)
+{
+    int ext = TARGET_LONG_BITS == 64;
+    uint8_t *miss[4];
+    int i, n = 0;
+
+    /* x0 = ras_top, ras_top = (ras_top - 1) % TB_RAS_SIZE */
+    tcg_out_ld(s, TCG_TYPE_I32, TCG_REG_X0, TCG_AREG0,
+               offsetof(CPUState, ras_top));
+    tcg_out_subi(s, 0, TCG_REG_X1, TCG_REG_X0, 1);
+    tcg_out_ubfm(s, 0, TCG_REG_X1, TCG_REG_X1, 0, TB_RAS_BITS - 1);
+    tcg_out_st(s, TCG_TYPE_I32, TCG_REG_X1, TCG_AREG0,
+               offsetof(CPUState, ras_top));
+
+    /* x0 = env + 8 * x0, indexing ras_pc[] and ras_tb[] */
+    tcg_out_arith(s, ARITH_ADD, 1, TCG_REG_X0, TCG_AREG0, TCG_REG_X0, -3);
+    tcg_out_ld(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, TCG_REG_X1, TCG_REG_X0,
+               offsetof(CPUState, ras_pc));
+    tcg_out_cmp(s, ext, TCG_REG_X1, pc, 0);
+    miss[n++] = s->code_ptr;
+    tcg_out32(s, 0x54000000 | COND_NE);
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X1, TCG_REG_X0,
+               offsetof(CPUState, ras_tb));
+    miss[n++] = s->code_ptr;
+    tcg_out_cbz_noaddr(s, 1, 0, TCG_REG_X1);
+
+    tcg_out_ld(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, cs_base));
+    if (cs_base) {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, cs_base);
+        tcg_out_cmp(s, ext, TCG_REG_X0, TCG_REG_TMP, 0);
+    } else {
+        tcg_out_cmp(s, ext, TCG_REG_X0, TCG_REG_XZR, 0);
+    }
+    miss[n++] = s->code_ptr;
+    tcg_out32(s, 0x54000000 | COND_NE);
+
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, flags));
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, flags);
+    tcg_out_cmp(s, 1, TCG_REG_X0, TCG_REG_TMP, 0);
+    miss[n++] = s->code_ptr;
+    tcg_out32(s, 0x54000000 | COND_NE);
+
+    /* x0 = tb->tc_ptr + tb->tb_jmp_offset[1] */
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X0, TCG_REG_X1,
+               offsetof(TranslationBlock, tc_ptr));
+    tcg_out_ldst(s, LDST_16, LDST_LD, TCG_REG_X1, TCG_REG_X1,
+                 offsetof(TranslationBlock, tb_jmp_offset[1]));
+    tcg_out_arith(s, ARITH_ADD, 1, TCG_REG_X0, TCG_REG_X0, TCG_REG_X1, 0);
+    tcg_out_gotor(s, TCG_REG_X0);
+
+    for (i = 0; i < n; i++) {
+        reloc_pc19(miss[i], (tcg_target_long)s->code_ptr);
+    }
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X0, TCG_AREG0,
+               offsetof(CPUState, ras_miss_count));
+    tcg_out_addi(s, 1, TCG_REG_X0, TCG_REG_X0, 1);
+    tcg_out_st(s, TCG_TYPE_I64, TCG_REG_X0, TCG_AREG0,
+               offsetof(CPUState, ras_miss_count));
+    tcg_out_lookup_tb(s, pc, cs_base, flags);
+}
+
 /* callee stack use example:
    stp     x29, x30, [sp,#-32]!
    mov     x29, sp
@@ -988,7 +1519,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
     switch (opc) {
     case INDEX_op_exit_tb:
         tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, args[0]);
-        tcg_out_goto(s, (tcg_target_long)tb_ret_addr);
+        tcg_out_goto_far(s, (tcg_target_long)tb_ret_addr);
         break;
 
     case INDEX_op_goto_tb:
@@ -1003,6 +1534,14 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
 
+    case INDEX_op_lookup_tb:
+        tcg_out_lookup_tb(s, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_lookup_ret_tb:
+        tcg_out_lookup_ret_tb(s, args[0], args[1], args[2]);
+        break;
+
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_call(s, args[0]);
@@ -1066,19 +1605,61 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_and_i64:
         ext = 1; /* fall through */
     case INDEX_op_and_i32:
-        tcg_out_arith(s, ARITH_AND, ext, args[0], args[1], args[2], 0);
+        if (const_args[2]) {
+            tcg_out_limm(s, LIMM_AND, ext, args[0], args[1], args[2]);
+        } else {
+            tcg_out_arith(s, ARITH_AND, ext, args[0], args[1], args[2], 0);
+        }
         break;
 
     case INDEX_op_or_i64:
         ext = 1; /* fall through */
     case INDEX_op_or_i32:
-        tcg_out_arith(s, ARITH_OR, ext, args[0], args[1], args[2], 0);
+        if (const_args[2]) {
+            tcg_out_limm(s, LIMM_OR, ext, args[0], args[1], args[2]);
+        } else {
+            tcg_out_arith(s, ARITH_OR, ext, args[0], args[1], args[2], 0);
+        }
         break;
 
     case INDEX_op_xor_i64:
         ext = 1; /* fall through */
     case INDEX_op_xor_i32:
-        tcg_out_arith(s, ARITH_XOR, ext, args[0], args[1], args[2], 0);
+        if (const_args[2]) {
+            tcg_out_limm(s, LIMM_XOR, ext, args[0], args[1], args[2]);
+        } else {
+            tcg_out_arith(s, ARITH_XOR, ext, args[0], args[1], args[2], 0);
+        }
+        break;
+
+    case INDEX_op_andc_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_andc_i32:
+        tcg_out_arith(s, ARITH_BIC, ext, args[0], args[1], args[2], 0);
+        break;
+
+    case INDEX_op_orc_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_orc_i32:
+        tcg_out_arith(s, ARITH_ORN, ext, args[0], args[1], args[2], 0);
+        break;
+
+    case INDEX_op_eqv_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_eqv_i32:
+        tcg_out_arith(s, ARITH_EON, ext, args[0], args[1], args[2], 0);
+        break;
+
+    case INDEX_op_not_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_not_i32:  /* MVN / ORN Wd, WZR, Wm */
+        tcg_out_arith(s, ARITH_ORN, ext, args[0], TCG_REG_XZR, args[1], 0);
+        break;
+
+    case INDEX_op_neg_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_neg_i32:  /* NEG / SUB Wd, WZR, Wm */
+        tcg_out_arith(s, ARITH_SUB, ext, args[0], TCG_REG_XZR, args[1], 0);
         break;
 
     case INDEX_op_mul_i64:
@@ -1087,6 +1668,42 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_mul(s, ext, args[0], args[1], args[2]);
         break;
 
+    case INDEX_op_div_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_div_i32:
+        tcg_out_div(s, 1, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_divu_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_divu_i32:
+        tcg_out_div(s, 0, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_rem_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_rem_i32:
+        tcg_out_rem(s, 1, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_remu_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_remu_i32:
+        tcg_out_rem(s, 0, ext, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_add2_i64:
+        tcg_out_addsub2(s, 0, 1, args[0], args[1], args[2], args[3],
+                        args[4], args[5]);
+        break;
+    case INDEX_op_sub2_i64:
+        tcg_out_addsub2(s, 1, 1, args[0], args[1], args[2], args[3],
+                        args[4], args[5]);
+        break;
+    case INDEX_op_mulu2_i64:
+        tcg_out_mul2(s, 0, args[0], args[1], args[2], args[3]);
+        break;
+    case INDEX_op_muls2_i64:
+        tcg_out_mul2(s, 1, args[0], args[1], args[2], args[3]);
+        break;
+
     case INDEX_op_shl_i64:
         ext = 1; /* fall through */
     case INDEX_op_shl_i32:
@@ -1140,6 +1757,27 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_deposit_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_deposit_i32: /* BFI / BFM Wd, Wn, (32 - pos), len - 1 */
+        tcg_out_bfm(s, ext, args[0], args[2],
+                    -args[3] & (ext ? 63 : 31), args[4] - 1);
+        break;
+
+    case INDEX_op_extract_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_extract_i32: /* UBFX / UBFM Wd, Wn, pos, pos + len - 1 */
+        tcg_out_ubfm(s, ext, args[0], args[1],
+                     args[2], args[2] + args[3] - 1);
+        break;
+
+    case INDEX_op_sextract_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_sextract_i32: /* SBFX / SBFM Wd, Wn, pos, pos + len - 1 */
+        tcg_out_sbfm(s, ext, args[0], args[1],
+                     args[2], args[2] + args[3] - 1);
+        break;
+
     case INDEX_op_brcond_i64:
         ext = 1; /* fall through */
     case INDEX_op_brcond_i32: /* CMP 0, 1, cond(2), label 3 */
@@ -1154,6 +1792,13 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_cset(s, 0, args[0], args[3]);
         break;
 
+    case INDEX_op_movcond_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_movcond_i32: /* CMP 1, 2, CSEL 0, 3, 4, cond(5) */
+        tcg_out_cmp(s, ext, args[1], args[2], 0);
+        tcg_out_csel(s, ext, args[0], args[3], args[4], args[5]);
+        break;
+
     case INDEX_op_qemu_ld8u:
         tcg_out_qemu_ld(s, args, 0 | 0);
         break;
@@ -1235,6 +1880,8 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_lookup_tb, { "j" } },
+    { INDEX_op_lookup_ret_tb, { "j" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
 
@@ -1271,12 +1918,22 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_sub_i64, { "r", "r", "r" } },
     { INDEX_op_mul_i32, { "r", "r", "r" } },
     { INDEX_op_mul_i64, { "r", "r", "r" } },
-    { INDEX_op_and_i32, { "r", "r", "r" } },
-    { INDEX_op_and_i64, { "r", "r", "r" } },
-    { INDEX_op_or_i32, { "r", "r", "r" } },
-    { INDEX_op_or_i64, { "r", "r", "r" } },
-    { INDEX_op_xor_i32, { "r", "r", "r" } },
-    { INDEX_op_xor_i64, { "r", "r", "r" } },
+    { INDEX_op_and_i32, { "r", "r", "rK" } },
+    { INDEX_op_and_i64, { "r", "r", "rL" } },
+    { INDEX_op_or_i32, { "r", "r", "rK" } },
+    { INDEX_op_or_i64, { "r", "r", "rL" } },
+    { INDEX_op_xor_i32, { "r", "r", "rK" } },
+    { INDEX_op_xor_i64, { "r", "r", "rL" } },
+    { INDEX_op_andc_i32, { "r", "r", "r" } },
+    { INDEX_op_andc_i64, { "r", "r", "r" } },
+    { INDEX_op_orc_i32, { "r", "r", "r" } },
+    { INDEX_op_orc_i64, { "r", "r", "r" } },
+    { INDEX_op_eqv_i32, { "r", "r", "r" } },
+    { INDEX_op_eqv_i64, { "r", "r", "r" } },
+    { INDEX_op_not_i32, { "r", "r" } },
+    { INDEX_op_not_i64, { "r", "r" } },
+    { INDEX_op_neg_i32, { "r", "r" } },
+    { INDEX_op_neg_i64, { "r", "r" } },
 
     { INDEX_op_shl_i32, { "r", "r", "ri" } },
     { INDEX_op_shr_i32, { "r", "r", "ri" } },
@@ -1289,10 +1946,33 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_rotl_i64, { "r", "r", "ri" } },
     { INDEX_op_rotr_i64, { "r", "r", "ri" } },
 
+    { INDEX_op_deposit_i32, { "r", "0", "r" } },
+    { INDEX_op_deposit_i64, { "r", "0", "r" } },
+    { INDEX_op_extract_i32, { "r", "r" } },
+    { INDEX_op_extract_i64, { "r", "r" } },
+    { INDEX_op_sextract_i32, { "r", "r" } },
+    { INDEX_op_sextract_i64, { "r", "r" } },
+
     { INDEX_op_brcond_i32, { "r", "r" } },
     { INDEX_op_setcond_i32, { "r", "r", "r" } },
     { INDEX_op_brcond_i64, { "r", "r" } },
     { INDEX_op_setcond_i64, { "r", "r", "r" } },
+    { INDEX_op_movcond_i32, { "r", "r", "r", "r", "r" } },
+    { INDEX_op_movcond_i64, { "r", "r", "r", "r", "r" } },
+
+    { INDEX_op_div_i32, { "r", "r", "r" } },
+    { INDEX_op_div_i64, { "r", "r", "r" } },
+    { INDEX_op_divu_i32, { "r", "r", "r" } },
+    { INDEX_op_divu_i64, { "r", "r", "r" } },
+    { INDEX_op_rem_i32, { "r", "r", "r" } },
+    { INDEX_op_rem_i64, { "r", "r", "r" } },
+    { INDEX_op_remu_i32, { "r", "r", "r" } },
+    { INDEX_op_remu_i64, { "r", "r", "r" } },
+
+    { INDEX_op_add2_i64, { "r", "r", "r", "r", "r", "r" } },
+    { INDEX_op_sub2_i64, { "r", "r", "r", "r", "r", "r" } },
+    { INDEX_op_mulu2_i64, { "r", "r", "r", "r" } },
+    { INDEX_op_muls2_i64, { "r", "r", "r", "r" } },
 
     { INDEX_op_qemu_ld8u, { "r", "l" } },
     { INDEX_op_qemu_ld8s, { "r", "l" } },
@@ -1362,26 +2042,6 @@ static void tcg_target_init(TCGContext *s)
     tcg_add_target_add_op_defs(aarch64_op_defs);
 }
 
-static inline void tcg_out_addi(TCGContext *s, int ext,
-                                TCGReg rd, TCGReg rn, unsigned int aimm)
-{
-    /* add immediate aimm unsigned 12bit value (we use LSL 0 - no shift) */
-    /* using ADD 0x11000000 | (ext) | (aimm << 10) | (rn << 5) | rd */
-    unsigned int base = ext ? 0x91000000 : 0x11000000;
-    assert(aimm <= 0xfff);
-    tcg_out32(s, base | (aimm << 10) | (rn << 5) | rd);
-}
-
-static inline void tcg_out_subi(TCGContext *s, int ext,
-                                TCGReg rd, TCGReg rn, unsigned int aimm)
-{
-    /* sub immediate aimm unsigned 12bit value (we use LSL 0 - no shift) */
-    /* using SUB 0x51000000 | (ext) | (aimm << 10) | (rn << 5) | rd */
-    unsigned int base = ext ? 0xd1000000 : 0x51000000;
-    assert(aimm <= 0xfff);
-    tcg_out32(s, base | (aimm << 10) | (rn << 5) | rd);
-}
-
 static void tcg_target_qemu_prologue(TCGContext *s)
 {
     /* NB: frame sizes are in 16 byte stack units! */
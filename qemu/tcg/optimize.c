@@ -642,7 +642,6 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         case INDEX_op_set_label:
         case INDEX_op_jmp:
         case INDEX_op_br:
-        CASE_OP_32_64(brcond):
             memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
             for (i = 0; i < def->nb_args; i++) {
                 *gen_args = *args;
@@ -650,6 +649,21 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 gen_args++;
             }
             break;
+        CASE_OP_32_64(brcond):
+            /* The block goes on after a conditional branch, so what is
+               known about globals and local temps still holds. Only the
+               temps die and must not be referred to by a copy. */
+            for (i = nb_globals; i < nb_temps; i++) {
+                if (!s->temps[i].temp_local) {
+                    reset_temp(i, nb_temps, nb_globals);
+                }
+            }
+            for (i = 0; i < def->nb_args; i++) {
+                *gen_args = *args;
+                args++;
+                gen_args++;
+            }
+            break;
         default:
             /* Default case: we do know nothing about operation so no
                propagation is done.  We only trash output args.  */
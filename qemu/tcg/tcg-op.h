@@ -2133,6 +2133,185 @@ static inline void tcg_gen_deposit_i64(TCGv_i64 ret, TCGv_i64 arg1,
 #endif
 }
 
+/* Extract the bitfield of LEN bits at OFS from ARG, zero extended
+   (extract) or sign extended (sextract) into RET. */
+static inline void tcg_gen_extract_i32(TCGv_i32 ret, TCGv_i32 arg,
+                                       unsigned int ofs, unsigned int len)
+{
+#if TCG_TARGET_HAS_extract_i32
+    tcg_gen_op4ii_i32(INDEX_op_extract_i32, ret, arg, ofs, len);
+#else
+    if (ofs + len == 32) {
+        tcg_gen_shri_i32(ret, arg, ofs);
+    } else {
+        tcg_gen_shri_i32(ret, arg, ofs);
+        tcg_gen_andi_i32(ret, ret, (1u << len) - 1);
+    }
+#endif
+}
+
+static inline void tcg_gen_extract_i64(TCGv_i64 ret, TCGv_i64 arg,
+                                       unsigned int ofs, unsigned int len)
+{
+#if TCG_TARGET_HAS_extract_i64
+    tcg_gen_op4ii_i64(INDEX_op_extract_i64, ret, arg, ofs, len);
+#else
+    if (ofs + len == 64) {
+        tcg_gen_shri_i64(ret, arg, ofs);
+    } else {
+        tcg_gen_shri_i64(ret, arg, ofs);
+        tcg_gen_andi_i64(ret, ret, (1ull << len) - 1);
+    }
+#endif
+}
+
+static inline void tcg_gen_sextract_i32(TCGv_i32 ret, TCGv_i32 arg,
+                                        unsigned int ofs, unsigned int len)
+{
+#if TCG_TARGET_HAS_sextract_i32
+    tcg_gen_op4ii_i32(INDEX_op_sextract_i32, ret, arg, ofs, len);
+#else
+    tcg_gen_shli_i32(ret, arg, 32 - len - ofs);
+    tcg_gen_sari_i32(ret, ret, 32 - len);
+#endif
+}
+
+static inline void tcg_gen_sextract_i64(TCGv_i64 ret, TCGv_i64 arg,
+                                        unsigned int ofs, unsigned int len)
+{
+#if TCG_TARGET_HAS_sextract_i64
+    tcg_gen_op4ii_i64(INDEX_op_sextract_i64, ret, arg, ofs, len);
+#else
+    tcg_gen_shli_i64(ret, arg, 64 - len - ofs);
+    tcg_gen_sari_i64(ret, ret, 64 - len);
+#endif
+}
+
+static inline void tcg_gen_movcond_i32(TCGCond cond, TCGv_i32 ret,
+                                       TCGv_i32 c1, TCGv_i32 c2,
+                                       TCGv_i32 v1, TCGv_i32 v2)
+{
+#if TCG_TARGET_HAS_movcond_i32
+    tcg_gen_op6i_i32(INDEX_op_movcond_i32, ret, c1, c2, v1, v2, cond);
+#else
+    TCGv_i32 t0 = tcg_temp_new_i32();
+    TCGv_i32 t1 = tcg_temp_new_i32();
+
+    tcg_gen_setcond_i32(cond, t0, c1, c2);
+    tcg_gen_neg_i32(t0, t0);
+    tcg_gen_and_i32(t1, v1, t0);
+    tcg_gen_andc_i32(ret, v2, t0);
+    tcg_gen_or_i32(ret, ret, t1);
+
+    tcg_temp_free_i32(t0);
+    tcg_temp_free_i32(t1);
+#endif
+}
+
+static inline void tcg_gen_movcond_i64(TCGCond cond, TCGv_i64 ret,
+                                       TCGv_i64 c1, TCGv_i64 c2,
+                                       TCGv_i64 v1, TCGv_i64 v2)
+{
+#if TCG_TARGET_HAS_movcond_i64
+    tcg_gen_op6i_i64(INDEX_op_movcond_i64, ret, c1, c2, v1, v2, cond);
+#else
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+
+    tcg_gen_setcond_i64(cond, t0, c1, c2);
+    tcg_gen_neg_i64(t0, t0);
+    tcg_gen_and_i64(t1, v1, t0);
+    tcg_gen_andc_i64(ret, v2, t0);
+    tcg_gen_or_i64(ret, ret, t1);
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+#endif
+}
+
+/* 128-bit arithmetic on pairs of 64-bit values */
+static inline void tcg_gen_add2_i64(TCGv_i64 rl, TCGv_i64 rh, TCGv_i64 al,
+                                    TCGv_i64 ah, TCGv_i64 bl, TCGv_i64 bh)
+{
+#if TCG_TARGET_HAS_add2_i64
+    tcg_gen_op6_i64(INDEX_op_add2_i64, rl, rh, al, ah, bl, bh);
+#else
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+
+    tcg_gen_add_i64(t0, al, bl);
+    tcg_gen_setcond_i64(TCG_COND_LTU, t1, t0, al);
+    tcg_gen_add_i64(rh, ah, bh);
+    tcg_gen_add_i64(rh, rh, t1);
+    tcg_gen_mov_i64(rl, t0);
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+#endif
+}
+
+static inline void tcg_gen_sub2_i64(TCGv_i64 rl, TCGv_i64 rh, TCGv_i64 al,
+                                    TCGv_i64 ah, TCGv_i64 bl, TCGv_i64 bh)
+{
+#if TCG_TARGET_HAS_sub2_i64
+    tcg_gen_op6_i64(INDEX_op_sub2_i64, rl, rh, al, ah, bl, bh);
+#else
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+
+    tcg_gen_sub_i64(t0, al, bl);
+    tcg_gen_setcond_i64(TCG_COND_LTU, t1, al, bl);
+    tcg_gen_sub_i64(rh, ah, bh);
+    tcg_gen_sub_i64(rh, rh, t1);
+    tcg_gen_mov_i64(rl, t0);
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+#endif
+}
+
+static inline void tcg_gen_mulu2_i64(TCGv_i64 rl, TCGv_i64 rh,
+                                     TCGv_i64 arg1, TCGv_i64 arg2)
+{
+#if TCG_TARGET_HAS_mulu2_i64
+    tcg_gen_op4_i64(INDEX_op_mulu2_i64, rl, rh, arg1, arg2);
+#else
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    int sizemask = 0;
+    /* Return value and both arguments are 64-bit and unsigned.  */
+    sizemask |= tcg_gen_sizemask(0, 1, 0);
+    sizemask |= tcg_gen_sizemask(1, 1, 0);
+    sizemask |= tcg_gen_sizemask(2, 1, 0);
+
+    tcg_gen_mul_i64(t0, arg1, arg2);
+    tcg_gen_helper64(tcg_helper_muluh_i64, sizemask, rh, arg1, arg2);
+    tcg_gen_mov_i64(rl, t0);
+
+    tcg_temp_free_i64(t0);
+#endif
+}
+
+static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
+                                     TCGv_i64 arg1, TCGv_i64 arg2)
+{
+#if TCG_TARGET_HAS_muls2_i64
+    tcg_gen_op4_i64(INDEX_op_muls2_i64, rl, rh, arg1, arg2);
+#else
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    int sizemask = 0;
+    /* Return value and both arguments are 64-bit and signed.  */
+    sizemask |= tcg_gen_sizemask(0, 1, 1);
+    sizemask |= tcg_gen_sizemask(1, 1, 1);
+    sizemask |= tcg_gen_sizemask(2, 1, 1);
+
+    tcg_gen_mul_i64(t0, arg1, arg2);
+    tcg_gen_helper64(tcg_helper_mulsh_i64, sizemask, rh, arg1, arg2);
+    tcg_gen_mov_i64(rl, t0);
+
+    tcg_temp_free_i64(t0);
+#endif
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -2186,6 +2365,39 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+#if TCG_TARGET_HAS_lookup_tb
+/* jump to the TB found in env->tb_jmp_cache for the guest pc, if its
+   cs_base and flags match. Otherwise, same as tcg_gen_exit_tb(0). */
+static inline void tcg_gen_lookup_tb(TCGv pc, target_ulong cs_base,
+                                     uint64_t flags)
+{
+    *gen_opc_ptr++ = INDEX_op_lookup_tb;
+#if TARGET_LONG_BITS == 32
+    *gen_opparam_ptr++ = GET_TCGV_I32(pc);
+#else
+    *gen_opparam_ptr++ = GET_TCGV_I64(pc);
+#endif
+    *gen_opparam_ptr++ = cs_base;
+    *gen_opparam_ptr++ = flags;
+}
+
+/* same as tcg_gen_lookup_tb(), but first pop the return address stack
+   and, if the prediction is pc, enter the return stub (goto_tb 1) of
+   the calling TB */
+static inline void tcg_gen_lookup_ret_tb(TCGv pc, target_ulong cs_base,
+                                         uint64_t flags)
+{
+    *gen_opc_ptr++ = INDEX_op_lookup_ret_tb;
+#if TARGET_LONG_BITS == 32
+    *gen_opparam_ptr++ = GET_TCGV_I32(pc);
+#else
+    *gen_opparam_ptr++ = GET_TCGV_I64(pc);
+#endif
+    *gen_opparam_ptr++ = cs_base;
+    *gen_opparam_ptr++ = flags;
+}
+#endif
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -2414,6 +2626,7 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_brcondi_tl tcg_gen_brcondi_i64
 #define tcg_gen_setcond_tl tcg_gen_setcond_i64
 #define tcg_gen_setcondi_tl tcg_gen_setcondi_i64
+#define tcg_gen_movcond_tl tcg_gen_movcond_i64
 #define tcg_gen_mul_tl tcg_gen_mul_i64
 #define tcg_gen_muli_tl tcg_gen_muli_i64
 #define tcg_gen_div_tl tcg_gen_div_i64
@@ -2447,6 +2660,8 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_rotr_tl tcg_gen_rotr_i64
 #define tcg_gen_rotri_tl tcg_gen_rotri_i64
 #define tcg_gen_deposit_tl tcg_gen_deposit_i64
+#define tcg_gen_extract_tl tcg_gen_extract_i64
+#define tcg_gen_sextract_tl tcg_gen_sextract_i64
 #define tcg_const_tl tcg_const_i64
 #define tcg_const_local_tl tcg_const_local_i64
 #else
@@ -2486,6 +2701,7 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_brcondi_tl tcg_gen_brcondi_i32
 #define tcg_gen_setcond_tl tcg_gen_setcond_i32
 #define tcg_gen_setcondi_tl tcg_gen_setcondi_i32
+#define tcg_gen_movcond_tl tcg_gen_movcond_i32
 #define tcg_gen_mul_tl tcg_gen_mul_i32
 #define tcg_gen_muli_tl tcg_gen_muli_i32
 #define tcg_gen_div_tl tcg_gen_div_i32
@@ -2518,6 +2734,8 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_rotr_tl tcg_gen_rotr_i32
 #define tcg_gen_rotri_tl tcg_gen_rotri_i32
 #define tcg_gen_deposit_tl tcg_gen_deposit_i32
+#define tcg_gen_extract_tl tcg_gen_extract_i32
+#define tcg_gen_sextract_tl tcg_gen_sextract_i32
 #define tcg_const_tl tcg_const_i32
 #define tcg_const_local_tl tcg_const_local_i32
 #endif
@@ -44,6 +44,9 @@ DEF(br, 0, 0, 1, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
 DEF(mov_i32, 1, 1, 0, 0)
 DEF(movi_i32, 1, 0, 1, 0)
 DEF(setcond_i32, 1, 2, 1, 0)
+#if TCG_TARGET_HAS_movcond_i32
+DEF(movcond_i32, 1, 4, 1, 0)
+#endif
 /* load/store */
 DEF(ld8u_i32, 1, 1, 1, 0)
 DEF(ld8s_i32, 1, 1, 1, 0)
@@ -81,12 +84,18 @@ DEF(rotr_i32, 1, 2, 0, 0)
 #if TCG_TARGET_HAS_deposit_i32
 DEF(deposit_i32, 1, 2, 2, 0)
 #endif
+#if TCG_TARGET_HAS_extract_i32
+DEF(extract_i32, 1, 1, 2, 0)
+#endif
+#if TCG_TARGET_HAS_sextract_i32
+DEF(sextract_i32, 1, 1, 2, 0)
+#endif
 
-DEF(brcond_i32, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF(brcond_i32, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | TCG_OPF_SIDE_EFFECTS)
 #if TCG_TARGET_REG_BITS == 32
 DEF(add2_i32, 2, 4, 0, 0)
 DEF(sub2_i32, 2, 4, 0, 0)
-DEF(brcond2_i32, 0, 4, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF(brcond2_i32, 0, 4, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | TCG_OPF_SIDE_EFFECTS)
 DEF(mulu2_i32, 2, 2, 0, 0)
 DEF(setcond2_i32, 1, 4, 1, 0)
 #endif
@@ -134,6 +143,9 @@ DEF(nor_i32, 1, 2, 0, 0)
 DEF(mov_i64, 1, 1, 0, 0)
 DEF(movi_i64, 1, 0, 1, 0)
 DEF(setcond_i64, 1, 2, 1, 0)
+#if TCG_TARGET_HAS_movcond_i64
+DEF(movcond_i64, 1, 4, 1, 0)
+#endif
 /* load/store */
 DEF(ld8u_i64, 1, 1, 1, 0)
 DEF(ld8s_i64, 1, 1, 1, 0)
@@ -174,8 +186,26 @@ DEF(rotr_i64, 1, 2, 0, 0)
 #if TCG_TARGET_HAS_deposit_i64
 DEF(deposit_i64, 1, 2, 2, 0)
 #endif
+#if TCG_TARGET_HAS_extract_i64
+DEF(extract_i64, 1, 1, 2, 0)
+#endif
+#if TCG_TARGET_HAS_sextract_i64
+DEF(sextract_i64, 1, 1, 2, 0)
+#endif
 
-DEF(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | TCG_OPF_SIDE_EFFECTS)
+#if TCG_TARGET_HAS_add2_i64
+DEF(add2_i64, 2, 4, 0, 0)
+#endif
+#if TCG_TARGET_HAS_sub2_i64
+DEF(sub2_i64, 2, 4, 0, 0)
+#endif
+#if TCG_TARGET_HAS_mulu2_i64
+DEF(mulu2_i64, 2, 2, 0, 0)
+#endif
+#if TCG_TARGET_HAS_muls2_i64
+DEF(muls2_i64, 2, 2, 0, 0)
+#endif
 #if TCG_TARGET_HAS_ext8s_i64
 DEF(ext8s_i64, 1, 1, 0, 0)
 #endif
@@ -234,6 +264,10 @@ DEF(debug_insn_start, 0, 0, 1, 0)
 #endif
 DEF(exit_tb, 0, 0, 1, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
 DEF(goto_tb, 0, 0, 1, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+#if TCG_TARGET_HAS_lookup_tb
+DEF(lookup_tb, 0, 1, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF(lookup_ret_tb, 0, 1, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+#endif
 /* Note: even if TARGET_LONG_BITS is not defined, the INDEX_op
    constants must be defined */
 #if TCG_TARGET_REG_BITS == 32
@@ -253,6 +253,47 @@ void tcg_prologue_init(TCGContext *s)
                        (unsigned long)s->code_ptr);
 }
 
+/* Record that [start, stop[ of generated code was written, instead of
+   flushing it from the instruction cache right away. This is fine for
+   anything that is only reached once cpu_exec() enters generated code
+   again, which calls tcg_icache_sync() first: new TBs, and links between
+   TBs. Ranges close to one another are merged, so that a run of TBs
+   written one after the other is flushed in one go. */
+void tcg_icache_dirty(TCGContext *s, unsigned long start, unsigned long stop)
+{
+    TCGCodeRange *r;
+    int i;
+
+    s->icache_dirty_total++;
+    for (i = 0; i < s->icache_dirty_count; i++) {
+        r = &s->icache_dirty[i];
+        if (start <= r->stop + TCG_ICACHE_MERGE_GAP &&
+            stop + TCG_ICACHE_MERGE_GAP >= r->start) {
+            if (start < r->start)
+                r->start = start;
+            if (stop > r->stop)
+                r->stop = stop;
+            return;
+        }
+    }
+    if (s->icache_dirty_count == TCG_ICACHE_DIRTY_RANGES)
+        tcg_icache_flush_dirty(s);
+    r = &s->icache_dirty[s->icache_dirty_count++];
+    r->start = start;
+    r->stop = stop;
+}
+
+void tcg_icache_flush_dirty(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->icache_dirty_count; i++) {
+        flush_icache_range(s->icache_dirty[i].start, s->icache_dirty[i].stop);
+    }
+    s->icache_flush_count += s->icache_dirty_count;
+    s->icache_dirty_count = 0;
+}
+
 void tcg_set_frame(TCGContext *s, int reg,
                    tcg_target_long start, tcg_target_long size)
 {
@@ -271,6 +312,7 @@ void tcg_func_start(TCGContext *s)
     s->labels = tcg_malloc(sizeof(TCGLabel) * TCG_MAX_LABELS);
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->tier = TCG_TIER_OPT;
 
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
@@ -611,6 +653,7 @@ void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
     }
 #endif /* TCG_TARGET_EXTEND_ARGS */
 
+    s->helper_call_count++;
     *gen_opc_ptr++ = INDEX_op_call;
     nparam = gen_opparam_ptr++;
 #if defined(TCG_TARGET_I386) && TCG_TARGET_REG_BITS < 64
@@ -1152,6 +1195,16 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs)
 #endif
 }
 
+/* no liveness analysis: all the arguments are considered live */
+static void tcg_liveness_none(TCGContext *s)
+{
+    int nb_ops;
+    nb_ops = gen_opc_ptr - gen_opc_buf;
+
+    s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
+    memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
+}
+
 #ifdef USE_LIVENESS_ANALYSIS
 
 /* set a nop for an operation using 'nb_args' */
@@ -1357,11 +1410,7 @@ static void tcg_liveness_analysis(TCGContext *s)
 /* dummy liveness analysis */
 static void tcg_liveness_analysis(TCGContext *s)
 {
-    int nb_ops;
-    nb_ops = gen_opc_ptr - gen_opc_buf;
-
-    s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
-    memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
+    tcg_liveness_none(s);
 }
 #endif
 
@@ -1537,6 +1586,45 @@ static void temp_save(TCGContext *s, int temp, TCGRegSet allocated_regs)
     }
 }
 
+/* store a temporary to memory but keep it where it is, so that it can
+   still be used from its register after the store. 'allocated_regs' is
+   used in case a temporary registers needs to be allocated to store a
+   constant. */
+static void temp_sync(TCGContext *s, int temp, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int reg;
+
+    ts = &s->temps[temp];
+    if (!ts->fixed_reg) {
+        switch(ts->val_type) {
+        case TEMP_VAL_REG:
+            if (!ts->mem_coherent) {
+                if (!ts->mem_allocated)
+                    temp_allocate_frame(s, temp);
+                tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+                ts->mem_coherent = 1;
+            }
+            break;
+        case TEMP_VAL_DEAD:
+            ts->val_type = TEMP_VAL_MEM;
+            break;
+        case TEMP_VAL_CONST:
+            reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type],
+                                allocated_regs);
+            if (!ts->mem_allocated)
+                temp_allocate_frame(s, temp);
+            tcg_out_movi(s, ts->type, reg, ts->val);
+            tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+            break;
+        case TEMP_VAL_MEM:
+            break;
+        default:
+            tcg_abort();
+        }
+    }
+}
+
 /* save globals to their cannonical location and assume they can be
    modified be the following code. 'allocated_regs' is used in case a
    temporary registers needs to be allocated to store a constant. */
@@ -1571,6 +1659,32 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, the taken path sees the same state as at the
+   end of a basic block. The fall through path continues the block: the
+   temporaries are dead, but the globals and local temporaries are only
+   synced to memory and stay in their registers. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+        if (ts->temp_local) {
+            temp_sync(s, i, allocated_regs);
+        } else {
+            if (ts->val_type == TEMP_VAL_REG) {
+                s->reg_to_temp[ts->reg] = -1;
+            }
+            ts->val_type = TEMP_VAL_DEAD;
+        }
+    }
+
+    for(i = 0; i < s->nb_globals; i++) {
+        temp_sync(s, i, allocated_regs);
+    }
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 
 static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args)
@@ -1736,7 +1850,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
     iarg_end: ;
     }
     
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cbranch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         /* mark dead temporaries and free the associated registers */
@@ -2039,14 +2155,18 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
-    gen_opparam_ptr =
-        tcg_optimize(s, gen_opc_ptr, gen_opparam_buf, tcg_op_defs);
+    if (s->tier != TCG_TIER_QUICK)
+        gen_opparam_ptr =
+            tcg_optimize(s, gen_opc_ptr, gen_opparam_buf, tcg_op_defs);
 #endif
 
 #ifdef CONFIG_PROFILER
     s->la_time -= profile_getclock();
 #endif
-    tcg_liveness_analysis(s);
+    if (s->tier == TCG_TIER_QUICK)
+        tcg_liveness_none(s);
+    else
+        tcg_liveness_analysis(s);
 #ifdef CONFIG_PROFILER
     s->la_time += profile_getclock();
 #endif
@@ -2162,12 +2282,13 @@ int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
             s->temp_count_max = s->nb_temps;
     }
 #endif
+    s->tier_op_count[s->tier] += gen_opc_ptr - gen_opc_buf;
 
     tcg_gen_code_common(s, gen_code_buf, -1);
 
-    /* flush instruction cache */
-    flush_icache_range((unsigned long)gen_code_buf, 
-                       (unsigned long)s->code_ptr);
+    /* flush instruction cache before the TB is executed */
+    tcg_icache_dirty(s, (unsigned long)gen_code_buf,
+                     (unsigned long)s->code_ptr);
     return s->code_ptr -  gen_code_buf;
 }
 
@@ -2180,6 +2301,34 @@ int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset)
     return tcg_gen_code_common(s, gen_code_buf, offset);
 }
 
+static void tcg_dump_tier_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    static const char * const tier_names[TCG_TIER_COUNT] = {
+        [TCG_TIER_QUICK] = "quick",
+        [TCG_TIER_OPT] = "opt",
+    };
+    TCGContext *s = &tcg_ctx;
+    int i;
+
+    for (i = 0; i < TCG_TIER_COUNT; i++) {
+        cpu_fprintf(f, "tier %d %-12s%" PRId64 " TBs, avg ops/TB %0.1f, "
+                    "host/guest bytes %0.1f, host bytes/insn %0.1f\n",
+                    i, tier_names[i],
+                    s->tier_tb_count[i],
+                    s->tier_tb_count[i] ?
+                    (double)s->tier_op_count[i] / s->tier_tb_count[i] : 0,
+                    s->tier_code_in_len[i] ?
+                    (double)s->tier_code_out_len[i] / s->tier_code_in_len[i] : 0,
+                    s->tier_insn_count[i] ?
+                    (double)s->tier_code_out_len[i] / s->tier_insn_count[i] : 0);
+#ifdef CONFIG_PROFILER
+        cpu_fprintf(f, "  cycles/in byte    %0.1f\n",
+                    s->tier_code_in_len[i] ?
+                    (double)s->tier_code_time[i] / s->tier_code_in_len[i] : 0);
+#endif
+    }
+}
+
 #ifdef CONFIG_PROFILER
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
@@ -2221,12 +2370,14 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 s->restore_count);
     cpu_fprintf(f, "  avg cycles        %0.1f\n",
                 s->restore_count ? (double)s->restore_time / s->restore_count : 0);
+    tcg_dump_tier_info(f, cpu_fprintf);
 
     dump_op_count();
 }
 #else
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
+    tcg_dump_tier_info(f, cpu_fprintf);
     cpu_fprintf(f, "[TCG profiler not compiled]\n");
 }
 #endif
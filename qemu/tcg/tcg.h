@@ -288,6 +288,25 @@ typedef struct TCGHelperInfo {
 
 typedef struct TCGContext TCGContext;
 
+/* ranges of generated code whose instruction cache maintenance is
+   pending, see tcg_icache_dirty() */
+#define TCG_ICACHE_DIRTY_RANGES 16
+/* dirty ranges closer than this are flushed together */
+#define TCG_ICACHE_MERGE_GAP    256
+
+typedef struct TCGCodeRange {
+    unsigned long start;
+    unsigned long stop;
+} TCGCodeRange;
+
+/* translation tiers: blocks are first translated quickly, and hot ones
+   are translated again with every optimization */
+enum {
+    TCG_TIER_QUICK, /* no tcg_optimize(), no liveness analysis */
+    TCG_TIER_OPT,
+    TCG_TIER_COUNT,
+};
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current;
@@ -326,6 +345,24 @@ struct TCGContext {
     int allocated_helpers;
     int helpers_sorted;
 
+    /* tier of the code being generated, set by the front end after
+       tcg_func_start() */
+    int tier;
+    int64_t tier_tb_count[TCG_TIER_COUNT];
+    int64_t tier_op_count[TCG_TIER_COUNT];
+    int64_t tier_code_in_len[TCG_TIER_COUNT];
+    int64_t tier_code_out_len[TCG_TIER_COUNT];
+    /* guest instructions translated */
+    int64_t tier_insn_count[TCG_TIER_COUNT];
+    /* calls to helpers emitted by the front end */
+    int64_t helper_call_count;
+
+    /* generated code written since the last tcg_icache_sync() */
+    TCGCodeRange icache_dirty[TCG_ICACHE_DIRTY_RANGES];
+    int icache_dirty_count;
+    int64_t icache_dirty_total; /* ranges recorded */
+    int64_t icache_flush_count; /* flush_icache_range() calls for them */
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -342,6 +379,7 @@ struct TCGContext {
     int64_t la_time;
     int64_t restore_count;
     int64_t restore_time;
+    int64_t tier_code_time[TCG_TIER_COUNT];
 #endif
 
 #ifdef CONFIG_DEBUG_TCG
@@ -378,6 +416,18 @@ static inline void *tcg_malloc(int size)
 
 void tcg_context_init(TCGContext *s);
 void tcg_prologue_init(TCGContext *s);
+
+void tcg_icache_dirty(TCGContext *s, unsigned long start, unsigned long stop);
+void tcg_icache_flush_dirty(TCGContext *s);
+
+/* make all code written since the last call visible to instruction
+   fetch. Must be done before executing generated code. */
+static inline void tcg_icache_sync(TCGContext *s)
+{
+    if (s->icache_dirty_count) {
+        tcg_icache_flush_dirty(s);
+    }
+}
 void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
@@ -453,6 +503,9 @@ typedef struct TCGArgConstraint {
 #define TCG_OPF_SIDE_EFFECTS 0x04 /* instruction has side effects : it
                                      cannot be removed if its output
                                      are not used */
+#define TCG_OPF_COND_BRANCH 0x08 /* conditional branch: temporaries die,
+                                    but globals stay in their registers
+                                    on the fall through path */
 
 typedef struct TCGOpDef {
     const char *name;
@@ -470,9 +523,16 @@ typedef struct TCGTargetOpDef {
     const char *args_ct_str[TCG_MAX_OP_ARGS];
 } TCGTargetOpDef;
 
+/* %a is the ASCII string conversion of the firmware's printf */
+#ifdef X86EMU_HOST_BUILD
+#define TCG_ABORT_FMT "%s:%d: tcg fatal error\n"
+#else
+#define TCG_ABORT_FMT "%a:%d: tcg fatal error\n"
+#endif
+
 #define tcg_abort() \
 do {\
-    fprintf(stderr, "%a:%d: tcg fatal error\n", __FILE__, __LINE__);\
+    fprintf(stderr, TCG_ABORT_FMT, __FILE__, __LINE__);\
     abort();\
 } while (0)
 
@@ -523,12 +583,15 @@ TCGv_i32 tcg_const_local_i32(int32_t val);
 TCGv_i64 tcg_const_local_i64(int64_t val);
 
 extern uint8_t *code_gen_prologue;
+/* pending instruction cache maintenance is done on the way in */
 #if defined(_ARCH_PPC) && !defined(_ARCH_PPC64)
 #define tcg_qemu_tb_exec(env, tb_ptr)                                    \
-    ((long REGPARM __attribute__ ((longcall)) (*)(void *, void *))code_gen_prologue)(env, tb_ptr)
+    (tcg_icache_sync(&tcg_ctx),                                          \
+     ((long REGPARM __attribute__ ((longcall)) (*)(void *, void *))code_gen_prologue)(env, tb_ptr))
 #else
 #define tcg_qemu_tb_exec(env, tb_ptr)                                    \
-    ((long REGPARM (*)(void *, void *))code_gen_prologue)(env, tb_ptr)
+    (tcg_icache_sync(&tcg_ctx),                                          \
+     ((long REGPARM (*)(void *, void *))code_gen_prologue)(env, tb_ptr))
 #endif
 
 #endif /* __TCG_TCG_H__ */
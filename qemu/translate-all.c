@@ -89,8 +89,13 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     gen_code_size = tcg_gen_code(s, gen_code_buf);
     *gen_code_size_ptr = gen_code_size;
+    s->tier_tb_count[s->tier]++;
+    s->tier_code_in_len[s->tier] += tb->size;
+    s->tier_code_out_len[s->tier] += gen_code_size;
+    s->tier_insn_count[s->tier] += tb->icount;
 #ifdef CONFIG_PROFILER
     s->code_time += profile_getclock();
+    s->tier_code_time[s->tier] += profile_getclock() - ti;
     s->code_in_len += tb->size;
     s->code_out_len += gen_code_size;
 #endif